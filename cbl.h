@@ -70,7 +70,39 @@ namespace cbl
 		string_vector enumerate_files(const char *path);
 		string_vector enumerate_directories(const char *path);
 
+		/// Returns the modification time stamp of the file, or 0 if it does not exist. Results are memoized in a
+		/// process-wide metadata cache for the duration of the build session, so that each distinct path is only
+		/// stat'ed once. Files modified behind cbl's back must be invalidated explicitly via invalidate_metadata().
 		uint64_t get_modification_timestamp(const char *path);
+		/// Same as above, but always queries the file system, bypassing (and not updating) the metadata cache.
+		uint64_t query_modification_timestamp(const char *path);
+
+		/// What the file system can tell about a file's contents without reading them.
+		struct file_identity
+		{
+			/// Comparable with get_modification_timestamp().
+			uint64_t timestamp;
+			uint64_t size;
+			/// Inode number on Linux, file index on Windows.
+			uint64_t inode;
+
+			bool operator==(const file_identity &other) const { return timestamp == other.timestamp && size == other.size && inode == other.inode; }
+			bool operator!=(const file_identity &other) const { return !(*this == other); }
+		};
+		/// Queries the identity of the file, bypassing the metadata cache. Returns false if it does not exist.
+		bool query_file_identity(const char *path, file_identity &identity);
+
+		/// Drops the memoized metadata of the given file. cbl's own file operations do this automatically.
+		void invalidate_metadata(const char *path);
+		/// Drops all the memoized metadata, starting a new build session.
+		void invalidate_all_metadata();
+
+		struct metadata_cache_stats
+		{
+			uint64_t hits;
+			uint64_t misses;
+		};
+		metadata_cache_stats get_metadata_cache_stats();
 
 		bool mkdir(const char *path, bool make_parent_directories);
 
@@ -83,6 +115,10 @@ namespace cbl
 		bool copy_file(const char *existing_path, const char *new_path, copy_flags flags);
 		bool move_file(const char *existing_path, const char *new_path, copy_flags flags);
 		bool delete_file(const char *path);
+		/// Bumps the modification time stamp of an existing file to the current time.
+		bool touch_file(const char *path);
+		/// Sets the modification time stamp of an existing file, in the units of query_modification_timestamp().
+		bool set_modification_timestamp(const char *path, uint64_t stamp);
 
 		void disinherit_stream(FILE *stream);
 
@@ -98,9 +134,30 @@ namespace cbl
 		/// Updates a file-backed cache. Useful for compiler response files, generated code etc.
 		/// Compares the contents against the file on the file system, and:
 		/// - if they are identical to the contents of the file, no action is taken;
-		/// - if they are different, the file gets overwritten by contents.
-		/// Returns true on success, false otherwise.
+		/// - if they are different, the file gets replaced by contents, atomically, by writing a temporary file and
+		///   renaming it over the original.
 		cache_update_result update_file_backed_cache(const char *path, const void *contents, size_t bytes);
+
+		/// Read-only memory mapping of an entire file.
+		class file_mapping
+		{
+		public:
+			/// Maps the file at the given path. Check is_valid() for success; empty files are never mapped.
+			explicit file_mapping(const char *path);
+			~file_mapping();
+
+			bool is_valid() const { return ptr != nullptr; }
+			const uint8_t *data() const { return ptr; }
+			size_t size() const { return length; }
+
+		private:
+			file_mapping(const file_mapping &) = delete;
+			file_mapping &operator=(const file_mapping &) = delete;
+
+			const uint8_t *ptr = nullptr;
+			size_t length = 0;
+			void *handle = nullptr;
+		};
 	};
 
 	// Factories for generating typical basic configurations.
@@ -152,6 +209,24 @@ namespace cbl
 		using base_type::base_type;
 	};
 
+	// Resources consumed by a process (and by the children it has waited for), as of it having been waited for. Fields
+	// that the platform doesn't report are left at zero.
+	struct process_usage
+	{
+		uint64_t user_usec;
+		uint64_t system_usec;
+		uint64_t peak_rss_kb;
+		// Block I/O operations.
+		uint64_t blocks_in;
+		uint64_t blocks_out;
+		uint64_t voluntary_context_switches;
+		uint64_t involuntary_context_switches;
+	};
+
+	// Called for a process in a group as soon as it finishes, with its index in the group and its exit code. Returning
+	// false stops waiting for the rest of the group.
+	typedef std::function<bool(size_t index, int exit_code)> process_exit_callback;
+
 	struct process
 	{
 		pipe_output_callback on_out, on_err;
@@ -159,6 +234,8 @@ namespace cbl
 		void *in[2];
 		void *out[2];
 		void *err[2];
+		// Filled in once the process has been waited for.
+		process_usage usage{};
 
 	private:
 		process();
@@ -171,6 +248,12 @@ namespace cbl
 			pipe_output_callback on_stderr = nullptr,
 			pipe_output_callback on_stdout = nullptr,
 			const std::vector<uint8_t> *stdin_buffer = nullptr, void *environment = nullptr);
+		// Same as above, but takes the command line already split into arguments, the first one being the path to the
+		// executable. Unlike with a plain command line, no shell-style word splitting or expansion takes place.
+		static deferred_process start_deferred(const string_vector &argv,
+			pipe_output_callback on_stderr = nullptr,
+			pipe_output_callback on_stdout = nullptr,
+			const std::vector<uint8_t> *stdin_buffer = nullptr, void *environment = nullptr);
 
 		// Launches a process immediately in an asynchronous manner (i.e. it will not block by default;
 		// any waiting needs to be made explicit). This is equivalent to calling start_deferred() and
@@ -182,6 +265,13 @@ namespace cbl
 		{
 			return start_deferred(commandline, on_stderr, on_stdout, stdin_buffer, environment)();
 		}
+		static inline std::shared_ptr<process> start_async(const string_vector &argv,
+			pipe_output_callback on_stderr = nullptr,
+			pipe_output_callback on_stdout = nullptr,
+			const std::vector<uint8_t> *stdin_buffer = nullptr, void *environment = nullptr)
+		{
+			return start_deferred(argv, on_stderr, on_stdout, stdin_buffer, environment)();
+		}
 
 		// Launches a process immediately in a synchronous manner (i.e. it will block until the process
 		// finishes). This is equivalent to calling start_async() and waiting for the process. Returns
@@ -197,6 +287,17 @@ namespace cbl
 			else
 				return -1;
 		}
+		static inline int start_sync(const string_vector &argv,
+			pipe_output_callback on_stderr = nullptr,
+			pipe_output_callback on_stdout = nullptr,
+			const std::vector<uint8_t> *stdin_buffer = nullptr, void *environment = nullptr)
+		{
+			auto p = start_async(argv, on_stderr, on_stdout, stdin_buffer, environment);
+			if (p)
+				return p->wait();
+			else
+				return -1;
+		}
 
 		// Explicitly gives up any control over the process and lets it run in the background.
 		void detach();
@@ -204,16 +305,83 @@ namespace cbl
 		// Waits for the process to finish. Returns its exit code.
 		int wait();
 
-		// Waits for all of the processes in the given group to finish. Returns a vector of their exit codes.
-		static std::vector<int> wait_for_multiple(const std::vector<std::shared_ptr<process>>& processes);
+		// Waits for the process to finish without blocking the calling thread. The process' pipes are drained as its
+		// output arrives, and on_exit is called with its exit code once it finishes. on_exit may be called from a
+		// thread internal to cbl, so it should be kept short.
+		static void wait_async(std::shared_ptr<process> p, std::function<void(int exit_code)> on_exit);
+
+		// Waits for all of the processes in the given group to finish, all at once, draining their pipes as output
+		// arrives. on_exit, if given, is called on the calling thread in the order the processes finish, so that results
+		// may be acted upon without waiting for the slowest process. Returns a vector of their exit codes, in group
+		// order. Processes that failed to launch (i.e. null) are reported as exiting with -1 before any others. Processes
+		// already waited for or detached are skipped, and get -1 in the result, as do those left running when on_exit
+		// stops the wait.
+		static std::vector<int> wait_for_multiple(const std::vector<std::shared_ptr<process>>& processes,
+			process_exit_callback on_exit = nullptr);
+
+		// Waits for whichever process in the given group finishes first, and returns its index (or the size of the group
+		// if there is nothing to wait for). The other processes are left running.
+		static inline size_t wait_for_any(const std::vector<std::shared_ptr<process>>& processes, int *exit_code = nullptr)
+		{
+			size_t first = processes.size();
+			wait_for_multiple(processes, [&](size_t index, int code)
+			{
+				first = index;
+				if (exit_code)
+					*exit_code = code;
+				return false;
+			});
+			return first;
+		}
 
 		static uint32_t get_current_pid();
 
 		static std::string get_current_executable_path();
 
+		// Replaces the current process image with the given executable, keeping the pid, the environment and any
+		// inheritable handles. The first argument is the path to the executable. Only returns on failure. Not supported
+		// on Windows, where it always fails.
+		static void exec(const string_vector &argv);
+
 		static void wait_for_pid(uint32_t pid);
 	};
 
+	// GNU make jobserver protocol support, so that processes spawned by cppbuild share a common budget of job slots
+	// with the make invoking it, or with other jobserver-aware tools that cppbuild spawns. Every process beyond the first
+	// needs to hold a token from the jobserver while it runs.
+	namespace jobserver
+	{
+		using token = int;
+		// Stands for the slot implicitly granted to this process, and is also what is handed out when no jobserver is
+		// in use.
+		constexpr token implicit_token = -1;
+		// Handed out when a token could not be acquired, so that the job runs anyway. Releasing it does nothing.
+		constexpr token no_token = -2;
+
+		// Connects to the jobserver advertised through the MAKEFLAGS environment variable, if any. Otherwise, starts
+		// one with the given number of slots and advertises it to child processes the same way (e.g. to nested makes
+		// or `gcc -flto=jobserver`). Job slots are left ungoverned if neither works out.
+		void initialize(uint32_t slots);
+
+		// Returns true if job slots are governed by a jobserver.
+		bool is_active();
+		// Returns true if the jobserver has been inherited from the invoking process, rather than started by this one.
+		bool is_inherited();
+
+		// Blocks until a job slot is available, and returns the token that must be given back once the job finishes.
+		token acquire();
+		// Like acquire(), but returns false instead of blocking if no job slot is available right now.
+		bool try_acquire(token &t);
+		// Calls callback once, from a thread internal to cbl, when another process may have given a token back, so that
+		// try_acquire() is worth retrying. Tokens given back by this process are not watched for. Only the most recent
+		// callback is kept, and passing an empty one cancels it; either way, a replaced callback is not running anymore
+		// once this returns, so the callback must not call into the jobserver itself.
+		void notify_when_available(std::function<void()> callback);
+
+		// Gives the token back to the jobserver. May be called from any thread.
+		void release(token t);
+	}
+
 	constexpr platform get_host_platform();
 	constexpr const char *get_platform_str(platform);
 	constexpr const char *get_host_platform_str();
@@ -224,6 +392,18 @@ namespace cbl
 
 	size_t combine_hash(size_t a, size_t b);
 
+	// 128-bit, non-cryptographic fingerprint, stable across cppbuild builds on platforms of the same endianness.
+	struct fingerprint
+	{
+		uint64_t lo, hi;
+
+		bool operator==(const fingerprint &other) const { return lo == other.lo && hi == other.hi; }
+		bool operator!=(const fingerprint &other) const { return !(*this == other); }
+	};
+	// Computes the fingerprint of the data (MurmurHash3 x64_128). Pass the fingerprint of preceding data as the seed
+	// to chain them.
+	fingerprint compute_fingerprint(const void *data, size_t size, fingerprint seed = fingerprint{ 0, 0 });
+
 	enum class severity : uint8_t
 	{
 		debug,
@@ -113,9 +113,11 @@ namespace graph
 namespace cbl
 {
 	struct process;
+	struct fingerprint;
 	class deferred_process;
 	typedef std::function<void(const void*, size_t)> pipe_output_callback;
 };
+struct timestamp_cache;
 
 struct target_data
 {
@@ -148,9 +150,15 @@ struct toolchain
 {
 	virtual bool initialize() = 0;
 	virtual cbl::deferred_process schedule_compiler(struct build_context &,
-		const char *path_to_response_file) = 0;
+		const char *path_to_response_file,
+		const graph::action &compile_action) = 0;
 	virtual cbl::deferred_process schedule_linker(struct build_context &,
 		const char *path_to_response_file) = 0;
+	/// Called after a successful compilation. Toolchains that have the compiler emit dependencies as a by-product
+	/// of compilation feed them into the dependency cache here. Does nothing by default, for toolchains that always
+	/// scan dependencies up front.
+	virtual void capture_dependencies_for_cpptu(struct build_context &,
+		const graph::action &) {}
 	virtual std::shared_ptr<graph::action> generate_compile_action_for_cpptu(
 		struct build_context &,
 		const char *path) = 0;
@@ -172,7 +180,8 @@ struct generic_cpp_toolchain : public toolchain
 		struct build_context &,
 		const graph::action_vector& objects) override;
 
-	virtual void generate_dependency_actions_for_cpptu(
+	/// Returns false if the dependencies are not known yet and will be captured from the compilation itself.
+	virtual bool generate_dependency_actions_for_cpptu(
 		struct build_context &,
 		const char *source,
 		const char *response_file,
@@ -198,6 +207,9 @@ struct generic_cpp_toolchain : public toolchain
 	static std::string get_response_file_for_cpptu(
 		struct build_context &,
 		const char *source_path);
+	static std::string get_dependency_file_for_cpptu(
+		struct build_context &,
+		const char *source_path);
 	static std::string get_response_file_for_link_product(
 		struct build_context &,
 		const char *product_path);
@@ -205,6 +217,18 @@ struct generic_cpp_toolchain : public toolchain
 		struct build_context &,
 		const char *response_file,
 		const char *response_str);
+
+	/// Hashes preprocessor output, disregarding line markers and whitespace between tokens, so that only changes to
+	/// the tokens themselves make a difference. Comments are expected to have been stripped by the preprocessor.
+	static cbl::fingerprint hash_preprocessed_output(const char *data, size_t size);
+	/// Re-stamps the object of a translation unit whose preprocessed tokens are the same as the ones it was last
+	/// compiled from, so that it gets culled instead of recompiled. For use by dependency scans with --token-hashes.
+	void restamp_unchanged_object(
+		struct build_context &,
+		const char *source,
+		const cbl::fingerprint &previous_tokens,
+		uint64_t previous_newest_dependency,
+		const cbl::fingerprint &tokens);
 };
 
 typedef std::unordered_map<std::string, configuration_data> configuration_map;
@@ -214,10 +238,13 @@ struct build_context
 	const target &trg;
 	const configuration &cfg;
 	toolchain &tc;
+	// Dependency cache of the target, looked up once per build rather than once per translation unit.
+	timestamp_cache *dependency_cache = nullptr;
 };
 struct cull_context
 {
 	std::atomic_uint64_t self_timestamp;
+	// Time stamp that inputs are judged against, i.e. that of the object or product whose subgraph is being culled.
 	const uint64_t root_timestamp;
 
 	// Old-school workaround for GCC insisting on selecting the std::atomic<long unsigned int>::atomic(const std::atomic<long unsigned int>&) constructor in the aggregate initializer.
@@ -246,6 +273,9 @@ namespace graph
 		action_vector inputs;
 		string_vector outputs;
 		mutable std::vector<uint64_t> output_timestamps;
+		/// Id of the node this action became in the flat graph it was last flattened into. Only valid if that graph's
+		/// `actions` array maps the id back onto this action.
+		uint32_t node_id = 0;
 
 		virtual bool are_dependencies_met() = 0;
 		virtual uint64_t get_oldest_output_timestamp() const;
@@ -269,6 +299,8 @@ namespace graph
 		static_assert((action::action_type)include < action::cpp_actions_end, "Action type range overflow; increase action::cpp_actions_end");
 
 		std::string response_file;
+		// Set on compile actions whose dependencies are not cached and will be captured from the compilation itself. Such actions are never culled.
+		bool dependencies_unknown = false;
 
 		bool are_dependencies_met() override;
 	protected:
@@ -276,20 +308,100 @@ namespace graph
 		virtual bool internal_is_equivalent(action&) const override;
 	};
 
+	/// Flat, structure-of-arrays view of a build graph. Nodes are identified by 32-bit ids, assigned in post-order, so
+	/// every node's inputs have lower ids than the node itself and the root is always the last node. Edges are stored
+	/// in compressed sparse row form. An action shared by multiple consumers (e.g. an interned include) is a single
+	/// node. The `actions` array maps nodes back onto the action objects, which remain the public API for handlers
+	/// and graph hooks. A build flattens its graph once, and hands the same flat graph to manifest collection, culling
+	/// (which keeps it in line with what remains of the graph) and execution.
+	struct flat_graph
+	{
+		using node_id = uint32_t;
+
+		std::vector<action::action_type> types;
+		// Inputs of node n are input_ids[input_offsets[n]] up to, but excluding, input_ids[input_offsets[n + 1]].
+		std::vector<uint32_t> input_offsets;
+		std::vector<node_id> input_ids;
+		// Outputs are laid out the same way as inputs. Paths point into the actions' own strings.
+		std::vector<uint32_t> output_offsets;
+		std::vector<const char *> output_paths;
+		std::vector<uint64_t> output_timestamps;
+		std::vector<action_ptr> actions;
+
+		size_t size() const { return types.size(); }
+		const node_id *inputs_begin(node_id n) const { return input_ids.data() + input_offsets[n]; }
+		const node_id *inputs_end(node_id n) const { return input_ids.data() + input_offsets[n + 1]; }
+	};
+	/// Flattens the graph rooted at the given action. Output time stamps are copied from the actions where known, and
+	/// are 0 otherwise.
+	flat_graph flatten_build_graph(action_ptr root);
+	/// Queries the time stamps of all the outputs in the flat graph in parallel, and writes them back to the actions.
+	void update_output_timestamps(flat_graph &);
+
+	/// Returns the include action for the given header. There is only one such action per header in a build graph,
+	/// shared by all the translation units that depend on it.
+	std::shared_ptr<action> find_or_create_include_action(const std::string &path);
+
 	using dependency_timestamp_vector = std::vector<std::pair<std::string, uint64_t>>;
+	/// Looks up the dependencies of the translation unit, and returns true if they are all up to date. If token_hash is
+	/// given, it receives the preprocessed token hash recorded with the entry (see --token-hashes), even if the entry
+	/// turns out stale, and newest_dependency the newest time stamp among the entry's dependencies.
 	bool query_dependency_cache(build_context &,
 		const std::string& source,
 		const char *response,
-		std::function<void(const std::string &)> push_dep);
+		std::function<void(const std::string &)> push_dep,
+		cbl::fingerprint *token_hash = nullptr,
+		uint64_t *newest_dependency = nullptr);
 	void insert_dependency_cache(build_context &,
 		const std::string& source,
 		const char *response,
-		const dependency_timestamp_vector &deps);
+		const dependency_timestamp_vector &deps,
+		const cbl::fingerprint *token_hash = nullptr);
+	/// Returns true if the response file is known to hold contents of the given fingerprint, i.e. it was recorded with
+	/// it and its time stamp has not changed since, which spares reading the file back.
+	bool query_response_file_cache(const char *response_file, const cbl::fingerprint &contents);
+	/// Records the fingerprint of the contents that the response file has just been found or written with.
+	void insert_response_file_cache(const char *response_file, const cbl::fingerprint &contents);
+	/// Records that an output found up to date by other means than its time stamp (e.g. unchanged preprocessed tokens)
+	/// counts as built just now, without touching it, so that whatever depends on it need not be rebuilt.
+	void restamp_output(const char *path);
 	void save_timestamp_caches();
 
+	/// Build manifests list all the files of a target's build graph as of its last successful build, along with their
+	/// time stamps, so that a no-op build can tell that it is up to date without generating the graph. Returns true if
+	/// none of the files have changed since, and neither have the sources, the target and configuration descriptions,
+	/// nor the cppbuild executable that they come from.
+	bool query_build_manifest(build_context &, const string_vector &sources);
+	/// Collects the files of a freshly generated, not yet culled build graph. Outputs get a zero time stamp, and are
+	/// queried upon saving instead. Returns false if the graph is incomplete, i.e. some dependencies are unknown yet.
+	bool collect_build_manifest(const flat_graph &, dependency_timestamp_vector &files);
+	/// Saves the manifest once the build has succeeded.
+	void save_build_manifest(build_context &, const string_vector &sources, dependency_timestamp_vector &files);
+
+	/// Cache snapshots carry the dependency cache entries and the objects of a target's up to date translation units
+	/// over to other checkouts of the project, e.g. onto ephemeral CI runners. Paths are stored relative to the project
+	/// root, and sources and headers are identified by the hashes of their contents rather than by time stamps.
+	bool export_cache_snapshot(build_context &, const char *path);
+	/// Imports the translation units whose response, sources and headers match the local ones, and stamps them so
+	/// that they get culled. Returns the number of imported translation units, or -1 if the snapshot is unreadable.
+	int import_cache_snapshot(build_context &, const char *path);
+
+	/// Prints the given number of compiler and linker invocations that took the most CPU time, and those that peaked at
+	/// the most memory, out of the ones recorded with --usage-summary.
+	void print_usage_summary(size_t count);
+
 	std::shared_ptr<action> generate_cpp_build_graph(build_context &);
+	/// Generates, culls and executes the build graph in a pipelined fashion: each compile action starts executing as
+	/// soon as it is found outdated, without waiting for the rest of the graph. The link action is culled and executed
+	/// once all the compile actions have finished. Root is set to what remains of the graph after culling.
+	int pipeline_cpp_build_graph(build_context &, std::shared_ptr<action>& root);
+	/// Culls the graph, and compacts the flat graph, which must have been flattened from root, down to what remains.
 	void cull_build_graph(build_context &,
-		std::shared_ptr<action>& root);
+		std::shared_ptr<action>& root,
+		flat_graph &);
+	int execute_build_graph(build_context &,
+		const flat_graph &);
+	/// Flattens the graph first. Prefer the above if the flat graph is at hand.
 	int execute_build_graph(build_context &,
 		std::shared_ptr<action> root);
 	void clean_build_graph_outputs(build_context &,
@@ -39,6 +39,67 @@ namespace cbl
 		return a ^ (b + 0x9e3779b9 + (a << 6) + (a >> 2));
 	};
 
+	namespace detail
+	{
+		static inline uint64_t rotl64(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+
+		static inline uint64_t fmix64(uint64_t k)
+		{
+			k ^= k >> 33;
+			k *= 0xFF51AFD7ED558CCDull;
+			k ^= k >> 33;
+			k *= 0xC4CEB9FE1A85EC53ull;
+			k ^= k >> 33;
+			return k;
+		}
+	}
+
+	fingerprint compute_fingerprint(const void *data, size_t size, fingerprint seed)
+	{
+		using namespace detail;
+		// MurmurHash3 x64_128 by Austin Appleby (public domain), seeded with both halves of the seed.
+		constexpr uint64_t c1 = 0x87C37B91114253D5ull, c2 = 0x4CF5AD432745937Full;
+		const uint8_t *bytes = (const uint8_t *)data;
+		uint64_t h1 = seed.lo, h2 = seed.hi;
+		uint64_t k1, k2;
+
+		const size_t block_count = size / 16;
+		for (size_t i = 0; i < block_count; ++i)
+		{
+			memcpy(&k1, bytes + i * 16, sizeof(k1));
+			memcpy(&k2, bytes + i * 16 + 8, sizeof(k2));
+			k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+			h1 = rotl64(h1, 27); h1 += h2; h1 = h1 * 5 + 0x52DCE729;
+			k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+			h2 = rotl64(h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495AB5;
+		}
+
+		// Zero padding makes the tail equivalent to the reference byte-by-byte switch.
+		const size_t tail_size = size & 15;
+		uint8_t tail[16] = {};
+		memcpy(tail, bytes + block_count * 16, tail_size);
+		memcpy(&k1, tail, sizeof(k1));
+		memcpy(&k2, tail + 8, sizeof(k2));
+		if (tail_size > 8)
+		{
+			k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+		}
+		if (tail_size > 0)
+		{
+			k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+		}
+
+		h1 ^= size;
+		h2 ^= size;
+		h1 += h2;
+		h2 += h1;
+		h1 = fmix64(h1);
+		h2 = fmix64(h2);
+		h1 += h2;
+		h2 += h1;
+		return fingerprint{ h1, h2 };
+	}
+
 	namespace path
 	{
 		string_vector split(const char *path)
@@ -208,6 +269,8 @@ namespace cbl
 					a.erase(a.begin());
 					b.erase(b.begin());
 				}
+				else
+					break;
 			}
 
 			// Go up the tree as far as needed.
@@ -229,9 +292,53 @@ namespace cbl
 
 	namespace fs
 	{
+		static std::unordered_map<std::string, uint64_t> metadata_cache;
+		static std::mutex metadata_mutex;
+		static std::atomic<uint64_t> metadata_hits(0), metadata_misses(0);
+
+		uint64_t get_modification_timestamp(const char *path)
+		{
+			{
+				std::lock_guard<std::mutex> _(metadata_mutex);
+				auto it = metadata_cache.find(path);
+				if (it != metadata_cache.end())
+				{
+					++metadata_hits;
+					return it->second;
+				}
+			}
+
+			// Stat outside of the lock. Should another thread race us to it, it will have seen the same result anyway.
+			++metadata_misses;
+			uint64_t stamp = query_modification_timestamp(path);
+			std::lock_guard<std::mutex> _(metadata_mutex);
+			metadata_cache[path] = stamp;
+			return stamp;
+		}
+
+		void invalidate_metadata(const char *path)
+		{
+			std::lock_guard<std::mutex> _(metadata_mutex);
+			metadata_cache.erase(path);
+		}
+
+		void invalidate_all_metadata()
+		{
+			std::lock_guard<std::mutex> _(metadata_mutex);
+			metadata_cache.clear();
+			metadata_hits = 0;
+			metadata_misses = 0;
+		}
+
+		metadata_cache_stats get_metadata_cache_stats()
+		{
+			return metadata_cache_stats{ metadata_hits, metadata_misses };
+		}
+
 		cache_update_result update_file_backed_cache(const char *path, const void *contents, size_t byte_count)
 		{
-			// TODO: Hashing instead of memcmp().
+			// Callers that want to avoid reading the file back should keep fingerprints of the contents themselves (see
+			// generic_cpp_toolchain::update_response_file()).
 			using namespace cbl;
 
 			if (FILE * f = fopen(path, "rb"))
@@ -249,13 +356,16 @@ namespace cbl
 				// Assume outdated if there was an error.
 				bool had_error = ferror(f);
 				fclose(f);
-				if (!had_error && bytes > 0 && 0 == memcmp(existing_cache.data(), contents, bytes))
+				if (!had_error && bytes > 0 && bytes == byte_count && 0 == memcmp(existing_cache.data(), contents, bytes))
 					return cache_update_result::up_to_date;
 			}
 
-			// If we get here, the file was deemed outdated.
+			// If we get here, the file was deemed outdated. Write it aside and rename it over, so that an interrupted
+			// write never leaves a truncated file behind with a fresh time stamp.
 			fs::mkdir(path::get_directory(path).c_str(), true);
-			if (FILE * f = fopen(path, "wb"))
+			invalidate_metadata(path);
+			const std::string temp_path = std::string(path) + ".tmp";
+			if (FILE * f = fopen(temp_path.c_str(), "wb"))
 			{
 				size_t bytes = 0;
 				for (;;)
@@ -265,9 +375,12 @@ namespace cbl
 						break;
 				}
 				bool had_error = ferror(f);
-				fclose(f);
-				if (!had_error)
+				had_error |= 0 != fclose(f);
+				if (!had_error && fs::move_file(temp_path.c_str(), path, fs::overwrite))
 					return cache_update_result::outdated_success;
+				const int error = errno;
+				fs::delete_file(temp_path.c_str());
+				errno = error;
 			}
 			cbl::warning("Failed to write file-backed cache %s, reason: %s", path, strerror(errno));
 			return cache_update_result::outdated_failure;
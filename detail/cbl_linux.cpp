@@ -40,13 +40,24 @@ SOFTWARE.
 #include <stdlib.h>
 #include <unistd.h>
 #include <wordexp.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
 #include <sys/syscall.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 
+#include <mutex>
+#include <thread>
+
+#if !defined(SYS_pidfd_open)
+	#define SYS_pidfd_open 434	// Same on all architectures.
+#endif
+
 namespace cbl
 {
 	namespace path
@@ -60,6 +71,15 @@ namespace cbl
 			if (!realpath(path, (char *)abs.data()))
 			{
 				int error = errno;
+				if (error == ENOENT)
+				{
+					// Like GetFullPathNameA() on Windows, don't require the file itself to exist (e.g. link products
+					// that have not been built yet), so that the resulting path doesn't change once it does.
+					const char *sep = strrchr(path, '/');
+					std::string parent = !sep ? get_working_path() : (sep == path ? "/" : get_absolute(std::string(path, sep - path).c_str()));
+					if (!parent.empty())
+						return join(parent, sep ? sep + 1 : path);
+				}
 				cbl::log_verbose("Failed to get absolute path for %s, reason: %s", path, strerror(error));
 				return "";
 			}
@@ -122,7 +142,7 @@ namespace cbl
 	
 	namespace fs
 	{
-		uint64_t get_modification_timestamp(const char *path)
+		uint64_t query_modification_timestamp(const char *path)
 		{
 			uint64_t stamp = 0;
 			struct stat s;
@@ -134,6 +154,18 @@ namespace cbl
 			return stamp;
 		}
 
+		bool query_file_identity(const char *path, file_identity &identity)
+		{
+			struct stat s;
+			if (stat(path, &s))
+				return false;
+			identity.timestamp = s.st_mtim.tv_sec * 1000 * 1000;
+			identity.timestamp += s.st_mtim.tv_nsec / 1000;
+			identity.size = (uint64_t)s.st_size;
+			identity.inode = (uint64_t)s.st_ino;
+			return true;
+		}
+
 		namespace detail
 		{
 			string_vector enumerate_fs_items(const char *path, const bool files)
@@ -229,6 +261,8 @@ namespace cbl
 
 		bool copy_file(const char *existing_path, const char *new_path, copy_flags flags)
 		{
+			invalidate_metadata(new_path);
+
 			struct scoped_fd
 			{
 				~scoped_fd()
@@ -252,7 +286,8 @@ namespace cbl
 
 			cbl::scoped_guard cleanup([mem, s]() { munmap(mem, s.st_size); });
 
-			int fd_to = open(new_path, O_CREAT | O_WRONLY | (!!(flags & overwrite) ? O_TRUNC : 0), 0666);
+			// Carry the permission bits over, so that copies of executables stay executable.
+			int fd_to = open(new_path, O_CREAT | O_WRONLY | (!!(flags & overwrite) ? O_TRUNC : 0), s.st_mode & 0777);
 			if (fd_to < 0)
 				return false;
 
@@ -281,6 +316,9 @@ namespace cbl
 
 		bool move_file(const char *existing_path, const char *new_path, copy_flags flags)
 		{
+			invalidate_metadata(existing_path);
+			invalidate_metadata(new_path);
+
 			struct stat s;
 			if (stat(existing_path, &s) < 0)
 				return false;
@@ -295,14 +333,40 @@ namespace cbl
 					tv[1].tv_usec = s.st_mtim.tv_nsec / 1000;
 					if (utimes(new_path, tv) < 0)
 						return false;
-					return true;
 				}
+				return true;
 			}
 			return false;
 		}
 
+		file_mapping::file_mapping(const char *path)
+		{
+			int fd = open(path, O_RDONLY | O_CLOEXEC);
+			if (fd < 0)
+				return;
+			struct stat s;
+			if (fstat(fd, &s) == 0 && s.st_size > 0)
+			{
+				void *mem = mmap(nullptr, s.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+				if (mem != MAP_FAILED)
+				{
+					ptr = (const uint8_t *)mem;
+					length = s.st_size;
+				}
+			}
+			// The mapping stays valid after closing the descriptor.
+			close(fd);
+		}
+
+		file_mapping::~file_mapping()
+		{
+			if (ptr)
+				munmap(const_cast<uint8_t *>(ptr), length);
+		}
+
 		bool delete_file(const char *path)
 		{
+			invalidate_metadata(path);
 			if (unlink(path) == 0)
 			{
 				cbl::log_verbose("Deleted file %s", path);
@@ -318,6 +382,31 @@ namespace cbl
 			return false;
 		}
 
+		bool touch_file(const char *path)
+		{
+			invalidate_metadata(path);
+			if (utimensat(AT_FDCWD, path, nullptr, 0) == 0)
+				return true;
+			int error = errno;
+			cbl::log_verbose("Failed to touch file %s, reason: %s", path, strerror(error));
+			return false;
+		}
+
+		bool set_modification_timestamp(const char *path, uint64_t stamp)
+		{
+			invalidate_metadata(path);
+			timespec times[2];
+			times[0].tv_sec = 0;
+			times[0].tv_nsec = UTIME_OMIT;
+			times[1].tv_sec = stamp / (1000 * 1000);
+			times[1].tv_nsec = (stamp % (1000 * 1000)) * 1000;
+			if (utimensat(AT_FDCWD, path, times, 0) == 0)
+				return true;
+			int error = errno;
+			cbl::log_verbose("Failed to set time stamp of file %s, reason: %s", path, strerror(error));
+			return false;
+		}
+
 		void disinherit_stream(FILE *stream)
 		{
 			if (int fd = fileno(stream))
@@ -329,6 +418,52 @@ namespace cbl
 		}
 	}
 
+	namespace detail
+	{
+		// Size of the buffer output is read into, large enough for a full pipe to be drained in a single read().
+		static constexpr size_t pipe_buffer_size = 64 * 1024;
+
+		// Reads from a non-blocking pipe until it's empty. Returns false once the write end of the pipe has been closed.
+		static bool drain_pipe(int fd, pipe_output_callback &callback, std::vector<uint8_t> &buffer)
+		{
+			for (;;)
+			{
+				ssize_t count = read(fd, buffer.data(), buffer.size());
+				if (count > 0)
+					callback(buffer.data(), count);
+				else if (count == 0)
+					return false;
+				else if (errno != EINTR)
+					return errno == EAGAIN || errno == EWOULDBLOCK;
+			}
+		}
+
+		static void fill_usage(process_usage &usage, const rusage &ru)
+		{
+			usage.user_usec = (uint64_t)ru.ru_utime.tv_sec * 1000000 + ru.ru_utime.tv_usec;
+			usage.system_usec = (uint64_t)ru.ru_stime.tv_sec * 1000000 + ru.ru_stime.tv_usec;
+			// Reported in kilobytes on Linux.
+			usage.peak_rss_kb = ru.ru_maxrss;
+			usage.blocks_in = ru.ru_inblock;
+			usage.blocks_out = ru.ru_oublock;
+			usage.voluntary_context_switches = ru.ru_nvcsw;
+			usage.involuntary_context_switches = ru.ru_nivcsw;
+		}
+
+		static void close_process_pipes(process &p)
+		{
+			for (void **pipe : { p.in, p.out, p.err })
+			{
+				for (int end : { 0, 1 })
+				{
+					if ((int)(intptr_t)pipe[end] != -1)
+						close((int)(intptr_t)pipe[end]);
+					pipe[end] = (void *)(intptr_t)-1;
+				}
+			}
+		}
+	}
+
 	process::process()
 	{}
 
@@ -339,6 +474,29 @@ namespace cbl
 		const std::vector<uint8_t> *stdin_buffer, void *environment)
 	{
 		std::string commandline = not_owned_commandline;
+		return [=]() -> std::shared_ptr<process>
+		{
+			// Word splitting and quote removal only; command substitution is refused, and so are undefined variables.
+			wordexp_t args = { 0, nullptr, 0 };
+			if (wordexp(commandline.c_str(), &args, WRDE_UNDEF | WRDE_NOCMD) != 0 || args.we_wordc < 1)
+			{
+				wordfree(&args);
+				cbl::error("Failed to parse command line: %s", commandline.c_str());
+				return nullptr;
+			}
+			const string_vector argv(args.we_wordv, args.we_wordv + args.we_wordc);
+			wordfree(&args);
+			return start_deferred(argv, on_stderr, on_stdout, stdin_buffer, environment)();
+		};
+	}
+
+	deferred_process process::start_deferred(
+		const string_vector &argv,
+		pipe_output_callback on_stderr,
+		pipe_output_callback on_stdout,
+		const std::vector<uint8_t> *stdin_buffer, void *environment)
+	{
+		assert(!argv.empty());
 		// FIXME: Lifetime of callbacks, buffer & environment?
 		auto kickoff = [=]()->std::shared_ptr<process>
 		{
@@ -355,9 +513,11 @@ namespace cbl
 			int out[2] = { -1, -1 };
 			int err[2] = { -1, -1 };
 
+			// Only the ends dup'ed onto the standard streams get inherited; the child must see blocking pipes, or it would
+			// fail with EAGAIN whenever it outpaces us.
 			auto safe_create_pipe = [&](int p[2], bool inherit_write) -> bool
 			{
-				if (pipe2(p, O_NONBLOCK) < 0)
+				if (pipe2(p, O_CLOEXEC) < 0)
 				{
 					safe_close_pipes(in);
 					safe_close_pipes(err);
@@ -387,28 +547,27 @@ namespace cbl
 			if (out[pipe_write] != -1)
 				posix_spawn_file_actions_adddup2(&actions, out[pipe_write], STDOUT_FILENO);
 			if (err[pipe_write] != -1)
-				posix_spawn_file_actions_adddup2(&actions, out[pipe_write], STDERR_FILENO);
+				posix_spawn_file_actions_adddup2(&actions, err[pipe_write], STDERR_FILENO);
 
 			posix_spawnattr_t attr;
 			posix_spawnattr_init(&attr);
 
-			wordexp_t args = { 0, nullptr, 0 };
-			if (wordexp(commandline.c_str(), &args, WRDE_UNDEF) < 0 || args.we_wordc < 1)
-			{
-				wordfree(&args);
-				return nullptr;
-			}
+			std::vector<char *> arg_ptrs;
+			arg_ptrs.reserve(argv.size() + 1);
+			for (auto &arg : argv)
+				arg_ptrs.push_back(const_cast<char *>(arg.c_str()));
+			arg_ptrs.push_back(nullptr);
 
 			// Exported by libc.
 			std::vector<char *> ptrs;
 			char **env = environ;
 			if (environment)
 			{
-				char *s;
-				for (s = (char *)environment; *s; s += strlen(s) + 1);
+				for (char *s = (char *)environment; *s; s += strlen(s) + 1)
 				{
 					ptrs.push_back(s);
 				}
+				ptrs.push_back(nullptr);
 				env = ptrs.data();
 			}
 
@@ -416,14 +575,13 @@ namespace cbl
 			{
 				posix_spawnattr_destroy(&attr);
 				posix_spawn_file_actions_destroy(&actions);
-				wordfree(&args);
 			});
 
 			pid_t child_pid = 0;
-			if (posix_spawn(&child_pid, args.we_wordv[0], &actions, &attr, args.we_wordv, env) < 0)
+			// Returns the error number rather than setting errno.
+			if (int error = posix_spawn(&child_pid, arg_ptrs[0], &actions, &attr, arg_ptrs.data(), env))
 			{
-				int error = errno;
-
+				const std::string commandline = cbl::join(argv, " ");
 				cbl::error("Failed to launch: %s", commandline.c_str());
 				cbl::error("Reason: %s", strerror(error));
 
@@ -434,10 +592,45 @@ namespace cbl
 				return nullptr;
 			}
 
-			cbl::log_verbose("Launched process #%d: %s", child_pid, commandline.c_str());
+			cbl::log_verbose("Launched process #%d: %s", child_pid, cbl::join(argv, " ").c_str());
+
+			// Our copies of the child's ends would keep the pipes from ever reporting end of file.
+			auto close_child_end = [](int p[2], int end)
+			{
+				if (p[end] != -1)
+				{
+					close(p[end]);
+					p[end] = -1;
+				}
+			};
+			close_child_end(in, pipe_read);
+			close_child_end(out, pipe_write);
+			close_child_end(err, pipe_write);
+			for (int fd : { out[pipe_read], err[pipe_read] })
+			{
+				if (fd != -1)
+					fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+			}
 
 			if (stdin_buffer)
-				write(in[pipe_write], stdin_buffer->data(), stdin_buffer->size());
+			{
+				// FIXME: This may deadlock with a child that fills its output pipes before consuming all of its input.
+				const uint8_t *data = stdin_buffer->data();
+				size_t remaining = stdin_buffer->size();
+				while (remaining > 0)
+				{
+					ssize_t written = write(in[pipe_write], data, remaining);
+					if (written < 0 && errno != EINTR)
+						break;
+					else if (written > 0)
+					{
+						data += written;
+						remaining -= written;
+					}
+				}
+				// Let the child see the end of its input.
+				close_child_end(in, pipe_write);
+			}
 
 			p = new process();
 			p->on_err = on_stderr;
@@ -460,67 +653,57 @@ namespace cbl
 	{
 		MTR_SCOPE_I(__FILE__, "Wait for process", "handle", (uintptr_t)handle);
 
-		auto read_pipe_to_callback = [](void *pipe[2], std::vector<uint8_t> &buffer, pipe_output_callback& cb)
+		// Clogged pipes may stop the process from completing, so multiplex both of them until the process closes its
+		// ends, and only then reap it.
+		pollfd fds[2];
+		pipe_output_callback *callbacks[2];
+		nfds_t pipe_count = 0;
+		auto collect_pipe = [&](void *pipe[2], pipe_output_callback &cb)
 		{
-			if ((int)(intptr_t)pipe[pipe_read] != -1)
+			const int fd = (int)(intptr_t)pipe[pipe_read];
+			if (fd != -1)
 			{
-				ssize_t read = ::read((int)(intptr_t)pipe[pipe_read], buffer.data(), buffer.size());
-#define POLL_PIPES	0
-#if POLL_PIPES
-				if (read == -1)
-				{
-					if (errno == EAGAIN || errno == EWOULDBLOCK)
-						return false;
-					else
-						return true;
-				}
-				else if (read == 0)
-				{
-					return true;
-				}
-				cb(buffer.data(), read);
-				return false;
-			}
-			return true;
-#else
-				if (read > 0)
-					cb(buffer.data(), read);
-				return read;
+				fds[pipe_count].fd = fd;
+				fds[pipe_count].events = POLLIN;
+				callbacks[pipe_count++] = &cb;
 			}
-			return ssize_t(-1);
-#endif
 		};
+		collect_pipe(err, on_err);
+		collect_pipe(out, on_out);
 
-		std::vector<uint8_t> buffer;
-		buffer.resize(32);
+		std::vector<uint8_t> buffer(pipe_count > 0 ? detail::pipe_buffer_size : 0);
+		while (pipe_count > 0)
+		{
+			if (poll(fds, pipe_count, -1) < 0)
+			{
+				if (errno == EINTR)
+					continue;
+				cbl::log_verbose("Polling output of process #%d failed, reason: %s", (int)(intptr_t)handle, strerror(errno));
+				break;
+			}
+			for (nfds_t i = 0; i < pipe_count;)
+			{
+				if (fds[i].revents && !detail::drain_pipe(fds[i].fd, *callbacks[i], buffer))
+				{
+					// End of file, stop watching the pipe.
+					--pipe_count;
+					fds[i] = fds[pipe_count];
+					callbacks[i] = callbacks[pipe_count];
+				}
+				else
+					++i;
+			}
+		}
 
-		int result = 0;
 		int wstatus = 0;
-		do
-		{
-			// Clogged pipes may stop the process from completing. Keep polling until handle at index 0 (i.e. the process) completes.
-			while (read_pipe_to_callback(err, buffer, on_err) > 0);
-			while (read_pipe_to_callback(out, buffer, on_out) > 0);
-			constexpr int flags = POLL_PIPES ? WNOHANG : 0;
-			result = waitpid((pid_t)(intptr_t)handle, &wstatus, flags);
-			if (!!(flags & WNOHANG) && !result)
-				sched_yield();
-		} while (!result);
-
-		// Make sure to drain the pipes.
-		while (read_pipe_to_callback(err, buffer, on_err) > 0);
-		while (read_pipe_to_callback(out, buffer, on_out) > 0);
-		
-		auto safe_close_pipes = [](void *p[2])
-		{
-			if ((int)(intptr_t)p[pipe_write] != -1)
-				close((int)(intptr_t)p[pipe_write]);
-			if ((int)(intptr_t)p[pipe_read] != -1)
-				close((int)(intptr_t)p[pipe_read]);
-		};
-		safe_close_pipes(in);
-		safe_close_pipes(out);
-		safe_close_pipes(err);
+		rusage ru;
+		pid_t result;
+		while ((result = wait4((pid_t)(intptr_t)handle, &wstatus, 0, &ru)) < 0 && errno == EINTR);
+		if (result > 0)
+			detail::fill_usage(usage, ru);
+		// The pid may be recycled from now on.
+		handle = (void *)-1;
+		detail::close_process_pipes(*this);
 		return WIFEXITED(wstatus) ? WEXITSTATUS(wstatus) : -1;
 	}
 
@@ -528,25 +711,334 @@ namespace cbl
 	{
 		cbl::log_verbose("Detaching process handle #%d", (uintptr_t)handle);
 		handle = (void *)-1;
-		auto safe_close_pipes = [](void *p[2])
+		detail::close_process_pipes(*this);
+	}
+
+	namespace detail
+	{
+		// Processes waited upon asynchronously are watched by a single reactor thread, through an epoll instance that
+		// holds their pidfds and output pipes.
+		struct reactor_entry
 		{
-			if ((int)(intptr_t)p[pipe_write] != -1)
-				close((int)(intptr_t)p[pipe_write]);
-			if ((int)(intptr_t)p[pipe_read] != -1)
-				close((int)(intptr_t)p[pipe_read]);
+			std::shared_ptr<process> p;
+			std::function<void(int exit_code)> on_exit;
+			pid_t pid;
+			int pidfd;
+			int exit_code;
+			// Read ends of the stdout and stderr pipes, -1 if absent or closed.
+			int pipes[2];
+			pipe_output_callback *callbacks[2];
+			// All pipe ends owned by the process object, to be closed once it exits.
+			int owned_fds[6];
 		};
-		safe_close_pipes(in);
-		safe_close_pipes(out);
-		safe_close_pipes(err);
+
+		static int reactor_epoll = -1;
+		// Held while registering processes and while handling events, so that entries don't disappear from under us.
+		static std::mutex reactor_mutex;
+
+		// See jobserver::notify_when_available(). The address of token_watch tags the jobserver pipe's epoll events.
+		static std::function<void()> token_watch;
+		static std::mutex token_watch_mutex;
+		static bool token_watch_registered = false;
+
+		static void fire_token_watch()
+		{
+			std::lock_guard<std::mutex> _(token_watch_mutex);
+			std::function<void()> callback;
+			std::swap(callback, token_watch);
+			if (callback)
+				callback();
+		}
+
+		static void run_reactor()
+		{
+			MTR_META_THREAD_NAME("Process reactor");
+			std::vector<uint8_t> buffer(pipe_buffer_size);
+			std::vector<reactor_entry *> exited;
+			epoll_event events[64];
+			for (;;)
+			{
+				bool token_available = false;
+				int count = epoll_wait(reactor_epoll, events, sizeof(events) / sizeof(events[0]), -1);
+				if (count < 0)
+				{
+					if (errno == EINTR)
+						continue;
+					cbl::fatal(-1, "Process reactor failed, reason: %s", strerror(errno));
+				}
+
+				{
+					std::lock_guard<std::mutex> _(reactor_mutex);
+					for (int i = 0; i < count; ++i)
+					{
+						if (events[i].data.ptr == &token_watch)
+						{
+							// Registered one-shot, so it stays quiet until re-armed.
+							token_available = true;
+							continue;
+						}
+						auto e = static_cast<reactor_entry *>(events[i].data.ptr);
+						if (e->pid == 0)
+							continue;	// Already reaped in this batch.
+
+						for (int j = 0; j < 2; ++j)
+						{
+							if (e->pipes[j] != -1 && !drain_pipe(e->pipes[j], *e->callbacks[j], buffer))
+							{
+								epoll_ctl(reactor_epoll, EPOLL_CTL_DEL, e->pipes[j], nullptr);
+								e->pipes[j] = -1;
+							}
+						}
+
+						int wstatus = 0;
+						rusage ru;
+						pid_t result = wait4(e->pid, &wstatus, WNOHANG, &ru);
+						if (result == 0)
+							continue;
+						if (result == e->pid)
+							fill_usage(e->p->usage, ru);
+						// Make sure to drain the pipes.
+						for (int j = 0; j < 2; ++j)
+						{
+							if (e->pipes[j] != -1)
+								drain_pipe(e->pipes[j], *e->callbacks[j], buffer);
+						}
+						// Deregister explicitly: closing our descriptors doesn't remove them from the epoll set while
+						// their open file descriptions live on elsewhere (e.g. in a child forked meanwhile), and events
+						// would keep coming for the entry after it's been deleted.
+						for (int j = 0; j < 2; ++j)
+						{
+							if (e->pipes[j] != -1)
+							{
+								epoll_ctl(reactor_epoll, EPOLL_CTL_DEL, e->pipes[j], nullptr);
+								e->pipes[j] = -1;
+							}
+						}
+						epoll_ctl(reactor_epoll, EPOLL_CTL_DEL, e->pidfd, nullptr);
+						e->exit_code = (result == e->pid && WIFEXITED(wstatus)) ? WEXITSTATUS(wstatus) : -1;
+						e->pid = 0;
+						exited.push_back(e);
+					}
+				}
+
+				for (auto e : exited)
+				{
+					close(e->pidfd);
+					for (int fd : e->owned_fds)
+					{
+						if (fd != -1)
+							close(fd);
+					}
+					e->on_exit(e->exit_code);
+					delete e;
+				}
+				exited.clear();
+				if (token_available)
+					fire_token_watch();
+			}
+		}
+
+		static bool start_reactor()
+		{
+			static std::once_flag reactor_started;
+			std::call_once(reactor_started, []()
+			{
+				reactor_epoll = epoll_create1(EPOLL_CLOEXEC);
+				if (reactor_epoll >= 0)
+					std::thread(run_reactor).detach();
+				else
+					cbl::log_verbose("Failed to create the process reactor, reason: %s", strerror(errno));
+			});
+			return reactor_epoll >= 0;
+		}
+	}
+
+	void process::wait_async(std::shared_ptr<process> p, std::function<void(int exit_code)> on_exit)
+	{
+		using namespace detail;
+
+		const pid_t pid = (pid_t)(intptr_t)p->handle;
+		const int pidfd = start_reactor() ? (int)syscall(SYS_pidfd_open, pid, 0) : -1;
+		if (pidfd < 0)
+		{
+			// No reactor or no pidfd support (Linux < 5.3), fall back to a blocking wait on a thread of its own.
+			std::thread([p, on_exit]() { on_exit(p->wait()); }).detach();
+			return;
+		}
+
+		auto e = new reactor_entry;
+		e->p = p;
+		e->on_exit = on_exit;
+		e->pid = pid;
+		e->pidfd = pidfd;
+		e->exit_code = -1;
+		e->pipes[0] = (int)(intptr_t)p->out[pipe_read];
+		e->pipes[1] = (int)(intptr_t)p->err[pipe_read];
+		e->callbacks[0] = &p->on_out;
+		e->callbacks[1] = &p->on_err;
+		void **owned[] = { p->in, p->out, p->err };
+		for (int i = 0; i < 3; ++i)
+		{
+			e->owned_fds[i * 2 + pipe_read] = (int)(intptr_t)owned[i][pipe_read];
+			e->owned_fds[i * 2 + pipe_write] = (int)(intptr_t)owned[i][pipe_write];
+			// The reactor takes ownership.
+			owned[i][pipe_read] = owned[i][pipe_write] = (void *)(intptr_t)-1;
+		}
+
+		std::lock_guard<std::mutex> _(reactor_mutex);
+		epoll_event ev;
+		ev.events = EPOLLIN;
+		ev.data.ptr = e;
+		for (int fd : e->pipes)
+		{
+			if (fd != -1)
+				epoll_ctl(reactor_epoll, EPOLL_CTL_ADD, fd, &ev);
+		}
+		epoll_ctl(reactor_epoll, EPOLL_CTL_ADD, pidfd, &ev);
 	}
 
-	std::vector<int> process::wait_for_multiple(const std::vector<std::shared_ptr<process>>& processes)
+	std::vector<int> process::wait_for_multiple(const std::vector<std::shared_ptr<process>>& processes,
+		process_exit_callback on_exit)
 	{
-		std::vector<int> exit_codes;
-		// FIXME: This can be made to run much more concurrently than this.
-		for (auto p : processes)
+		MTR_SCOPE_I(__FILE__, "Wait for processes", "count", processes.size());
+
+		struct waited_process
+		{
+			size_t index;
+			pid_t pid;
+			int pidfd;
+			bool signalled;
+			// Read ends of the stdout and stderr pipes, -1 if absent or closed.
+			int pipes[2];
+			pipe_output_callback *callbacks[2];
+		};
+
+		std::vector<int> exit_codes(processes.size(), -1);
+		std::vector<waited_process> waited;
+		bool keep_waiting = true;
+		for (size_t i = 0; i < processes.size() && keep_waiting; ++i)
 		{
-			exit_codes.push_back(p->wait());
+			auto &p = processes[i];
+			if (!p)
+			{
+				if (on_exit)
+					keep_waiting = on_exit(i, -1);
+				continue;
+			}
+			const pid_t pid = (pid_t)(intptr_t)p->handle;
+			if (pid <= 0)
+				continue;
+			waited_process w;
+			w.index = i;
+			w.pid = pid;
+			w.pidfd = (int)syscall(SYS_pidfd_open, pid, 0);
+			w.signalled = false;
+			w.pipes[0] = (int)(intptr_t)p->out[pipe_read];
+			w.pipes[1] = (int)(intptr_t)p->err[pipe_read];
+			w.callbacks[0] = &p->on_out;
+			w.callbacks[1] = &p->on_err;
+			waited.push_back(w);
+		}
+
+		std::vector<uint8_t> buffer(detail::pipe_buffer_size);
+		std::vector<pollfd> fds;
+		// Which process and which of its descriptors (0 and 1 being pipes, 2 the pidfd) each pollfd belongs to.
+		std::vector<std::pair<size_t, int>> owners;
+		while (keep_waiting && !waited.empty())
+		{
+			fds.clear();
+			owners.clear();
+			bool needs_polling = false;
+			for (size_t i = 0; i < waited.size(); ++i)
+			{
+				auto &w = waited[i];
+				int watched[3] = { w.pipes[0], w.pipes[1], w.pidfd };
+				for (int j = 0; j < 3; ++j)
+				{
+					if (watched[j] == -1)
+						continue;
+					pollfd pfd;
+					pfd.fd = watched[j];
+					pfd.events = POLLIN;
+					pfd.revents = 0;
+					fds.push_back(pfd);
+					owners.push_back(std::make_pair(i, j));
+				}
+				needs_polling |= w.pidfd == -1;
+			}
+
+			// Without pidfds (Linux < 5.3) exits can't be waited upon alongside the pipes, so check back periodically.
+			if (poll(fds.data(), fds.size(), needs_polling ? 10 : -1) < 0)
+			{
+				if (errno == EINTR)
+					continue;
+				cbl::log_verbose("Polling process group failed, reason: %s", strerror(errno));
+				// Fall back to waiting for the processes one by one.
+				for (auto &w : waited)
+				{
+					if (w.pidfd != -1)
+						close(w.pidfd);
+					w.pidfd = -1;
+					exit_codes[w.index] = processes[w.index]->wait();
+					if (on_exit && !on_exit(w.index, exit_codes[w.index]))
+						break;
+				}
+				return exit_codes;
+			}
+
+			for (size_t k = 0; k < fds.size(); ++k)
+			{
+				if (!fds[k].revents)
+					continue;
+				auto &w = waited[owners[k].first];
+				const int j = owners[k].second;
+				if (j == 2)
+					w.signalled = true;
+				else if (!detail::drain_pipe(w.pipes[j], *w.callbacks[j], buffer))
+					w.pipes[j] = -1;
+			}
+
+			// Reap whoever has finished, in the order they are found.
+			for (auto it = waited.begin(); it != waited.end() && keep_waiting;)
+			{
+				int wstatus = 0;
+				rusage ru;
+				pid_t result = 0;
+				if (it->signalled || it->pidfd == -1)
+					result = wait4(it->pid, &wstatus, WNOHANG, &ru);
+				if (result == 0 || (result < 0 && errno == EINTR))
+				{
+					++it;
+					continue;
+				}
+
+				// Make sure to drain the pipes.
+				for (int j = 0; j < 2; ++j)
+				{
+					if (it->pipes[j] != -1)
+						detail::drain_pipe(it->pipes[j], *it->callbacks[j], buffer);
+				}
+				if (it->pidfd != -1)
+					close(it->pidfd);
+				auto &p = processes[it->index];
+				if (result == it->pid)
+					detail::fill_usage(p->usage, ru);
+				p->handle = (void *)-1;
+				detail::close_process_pipes(*p);
+
+				const size_t index = it->index;
+				exit_codes[index] = (result == it->pid && WIFEXITED(wstatus)) ? WEXITSTATUS(wstatus) : -1;
+				it = waited.erase(it);
+				if (on_exit)
+					keep_waiting = on_exit(index, exit_codes[index]);
+			}
+		}
+
+		// Processes left running remain waitable on their own.
+		for (auto &w : waited)
+		{
+			if (w.pidfd != -1)
+				close(w.pidfd);
 		}
 		return exit_codes;
 	}
@@ -576,6 +1068,24 @@ namespace cbl
 		return s;
 	}
 
+	void process::exec(const string_vector &argv)
+	{
+		assert(!argv.empty());
+		std::vector<char *> arg_ptrs;
+		arg_ptrs.reserve(argv.size() + 1);
+		for (auto &arg : argv)
+			arg_ptrs.push_back(const_cast<char *>(arg.c_str()));
+		arg_ptrs.push_back(nullptr);
+
+		cbl::log_verbose("Replacing process image: %s", cbl::join(argv, " ").c_str());
+		// Buffered output would be lost along with the old image.
+		fflush(nullptr);
+		execv(arg_ptrs[0], arg_ptrs.data());
+
+		int error = errno;
+		cbl::error("Failed to execute %s, reason: %s", arg_ptrs[0], strerror(error));
+	}
+
 	void process::wait_for_pid(uint32_t pid)
 	{
 		int wstatus = 0;
@@ -584,8 +1094,22 @@ namespace cbl
 			int error = errno;
 			if (error == ECHILD)
 			{
-				// FIXME: Polling sucks, there must be an event to listen to.
-				cbl::log_verbose("Pid %d isn't a child, falling back to procfs polling");
+				// A pidfd becomes readable once the process exits, child or not (Linux 5.3+).
+				const int pidfd = (int)syscall(SYS_pidfd_open, (pid_t)pid, 0);
+				if (pidfd >= 0)
+				{
+					pollfd pfd;
+					pfd.fd = pidfd;
+					pfd.events = POLLIN;
+					pfd.revents = 0;
+					while (poll(&pfd, 1, -1) < 0 && errno == EINTR);
+					close(pidfd);
+					return;
+				}
+				else if (errno == ESRCH)
+					return;	// Gone already.
+
+				cbl::log_verbose("Pid %d isn't a child and pidfds are unavailable, falling back to procfs polling", pid);
 				std::string proc_path("/proc/" + std::to_string(pid));
 				while (access(proc_path.c_str(), F_OK) == 0)
 				{
@@ -600,6 +1124,216 @@ namespace cbl
 				cbl::log_verbose("Waiting for pid %d failed; wstatus : %X, reason: %s", pid, wstatus, strerror(error));
 		}
 	}
+
+	namespace jobserver
+	{
+		// Our own, non-blocking view of the token pipe, and its write end.
+		static int read_fd = -1, write_fd = -1;
+		// Signalled whenever the implicit slot is given back, to wake up threads waiting for the token pipe.
+		static int wake_fd = -1;
+		static std::atomic<bool> implicit_taken{ false };
+		static bool inherited = false;
+
+		// Reads from a pipe shared with other processes must not block, or another process could snatch the token we
+		// were woken up for and leave us hanging. Reopening the pipe through procfs creates a new open file description,
+		// so that we can make it non-blocking without affecting the other processes. Returns -1 on failure.
+		static int open_nonblocking(int fd)
+		{
+			int reopened = open(("/proc/self/fd/" + std::to_string(fd)).c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+			if (reopened < 0)
+				cbl::log_verbose("Failed to reopen jobserver pipe, reason: %s", strerror(errno));
+			return reopened;
+		}
+
+		static bool connect(const char *makeflags)
+		{
+			// Newer makes say --jobserver-auth, older ones --jobserver-fds. The last occurrence wins, as in make itself.
+			const char *auth = nullptr;
+			for (const char *key : { "--jobserver-auth=", "--jobserver-fds=" })
+			{
+				for (const char *p = strstr(makeflags, key); p; p = strstr(p + 1, key))
+					auth = p + strlen(key);
+				if (auth)
+					break;
+			}
+			if (!auth)
+				return false;
+
+			std::string value(auth, strcspn(auth, " "));
+			int r = -1, w = -1;
+			if (value.compare(0, 5, "fifo:") == 0)
+			{
+				w = open(value.c_str() + 5, O_RDWR | O_CLOEXEC);
+				r = w < 0 ? -1 : open(value.c_str() + 5, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+				if (r < 0 && w >= 0)
+					close(w);
+			}
+			else if (2 == sscanf(value.c_str(), "%d,%d", &r, &w) && fcntl(r, F_GETFD) != -1 && fcntl(w, F_GETFD) != -1)
+				r = open_nonblocking(r);
+			else
+				r = -1;
+			if (r < 0)
+			{
+				cbl::warning("Jobserver advertised in MAKEFLAGS (%s) is not accessible, ignoring it. Hint: prefix the recipe line invoking cppbuild with '+'", value.c_str());
+				return false;
+			}
+			read_fd = r;
+			write_fd = w;
+			return true;
+		}
+
+		void initialize(uint32_t slots)
+		{
+			wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+			if (wake_fd < 0)
+			{
+				cbl::warning("Failed to create jobserver event, reason: %s", strerror(errno));
+				return;
+			}
+
+			const char *makeflags = getenv("MAKEFLAGS");
+			if (makeflags && connect(makeflags))
+			{
+				cbl::log_verbose("Using jobserver inherited through MAKEFLAGS");
+				inherited = true;
+				return;
+			}
+
+			// The pipe is not close-on-exec, so that children inherit it.
+			int fds[2];
+			if (slots == 0 || 0 != pipe(fds))
+				return;
+			// Our own slot is implicit. Children may expect blocking reads, so only our own view is non-blocking.
+			std::string tokens(slots - 1, '+');
+			const int r = open_nonblocking(fds[0]);
+			if (r < 0 || (!tokens.empty() && (ssize_t)tokens.size() != write(fds[1], tokens.data(), tokens.size())))
+			{
+				cbl::warning("Failed to start a jobserver with %u slots, reason: %s", slots, strerror(errno));
+				if (r >= 0)
+					close(r);
+				close(fds[0]);
+				close(fds[1]);
+				return;
+			}
+			read_fd = r;
+			write_fd = fds[1];
+
+			// Keep whatever else make has passed down.
+			std::string flags = makeflags ? makeflags : "";
+			if (!flags.empty())
+				flags += ' ';
+			flags += "-j" + std::to_string(slots) + " --jobserver-auth=" + std::to_string(fds[0]) + "," + std::to_string(fds[1]);
+			setenv("MAKEFLAGS", flags.c_str(), 1);
+			cbl::log_verbose("Started jobserver with %u slots", slots);
+		}
+
+		bool is_active() { return read_fd >= 0; }
+
+		bool is_inherited() { return inherited; }
+
+		bool try_acquire(token &t)
+		{
+			if (read_fd < 0 || !implicit_taken.exchange(true))
+			{
+				t = implicit_token;
+				return true;
+			}
+
+			uint8_t c;
+			ssize_t count = read(read_fd, &c, 1);
+			if (count == 1)
+			{
+				t = (token)c;
+				return true;
+			}
+			if (count < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+			{
+				cbl::error("Failed to acquire a jobserver token, reason: %s", strerror(errno));
+				// FIXME: Treat this as fatal? Going on merely oversubscribes.
+				t = no_token;
+				return true;
+			}
+			return false;
+		}
+
+		token acquire()
+		{
+			for (;;)
+			{
+				token t;
+				if (try_acquire(t))
+					return t;
+
+				pollfd pfds[2] = { { read_fd, POLLIN, 0 }, { wake_fd, POLLIN, 0 } };
+				if (poll(pfds, 2, -1) > 0 && (pfds[1].revents & POLLIN))
+				{
+					uint64_t value;
+					(void)!read(wake_fd, &value, sizeof(value));
+				}
+			}
+		}
+
+		void notify_when_available(std::function<void()> callback)
+		{
+			using namespace detail;
+			std::unique_lock<std::mutex> lock(token_watch_mutex);
+			token_watch = std::move(callback);
+			if (!token_watch || read_fd < 0)
+			{
+				// Without a jobserver, there is nothing to wait for.
+				lock.unlock();
+				fire_token_watch();
+				return;
+			}
+
+			if (start_reactor())
+			{
+				// Level-triggered, so a token that has already arrived fires right away.
+				epoll_event ev;
+				ev.events = EPOLLIN | EPOLLONESHOT;
+				ev.data.ptr = &token_watch;
+				if (0 == epoll_ctl(reactor_epoll, token_watch_registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, read_fd, &ev))
+				{
+					token_watch_registered = true;
+					return;
+				}
+				cbl::log_verbose("Failed to watch the jobserver pipe, reason: %s", strerror(errno));
+			}
+			// Fall back to a thread of its own. Should the callback get cancelled meanwhile, it finds nothing to call.
+			std::thread([]()
+			{
+				pollfd pfd = { read_fd, POLLIN, 0 };
+				while (poll(&pfd, 1, -1) < 0 && errno == EINTR)
+					;
+				fire_token_watch();
+			}).detach();
+		}
+
+		void release(token t)
+		{
+			if (t == no_token)
+				return;
+			if (t == implicit_token)
+			{
+				if (read_fd >= 0)
+				{
+					implicit_taken = false;
+					const uint64_t one = 1;
+					(void)!write(wake_fd, &one, sizeof(one));
+				}
+				return;
+			}
+			const uint8_t c = (uint8_t)t;
+			while (1 != write(write_fd, &c, 1))
+			{
+				if (errno != EINTR)
+				{
+					cbl::error("Failed to release a jobserver token, reason: %s", strerror(errno));
+					break;
+				}
+			}
+		}
+	}
 }
 
 void init_process_group()
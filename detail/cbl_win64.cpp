@@ -31,11 +31,15 @@ SOFTWARE.
 #define NOMINMAX
 #include <Windows.h>
 #include <io.h>
+#include <Psapi.h>
 #pragma comment(lib, "advapi32.lib")
 #pragma comment(lib, "oleaut32.lib")
 #pragma comment(lib, "ole32.lib")
 #pragma comment(lib, "shell32.lib")
 
+#include <mutex>
+#include <thread>
+
 namespace cbl
 {
 	namespace win64
@@ -135,7 +139,7 @@ namespace cbl
 	
 	namespace fs
 	{
-		uint64_t get_modification_timestamp(const char *path)
+		uint64_t query_modification_timestamp(const char *path)
 		{
 			uint64_t stamp = 0;
 			HANDLE f = CreateFileA(path, FILE_READ_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, 0, nullptr);
@@ -152,6 +156,24 @@ namespace cbl
 			return stamp;
 		}
 
+		bool query_file_identity(const char *path, file_identity &identity)
+		{
+			HANDLE f = CreateFileA(path, FILE_READ_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, 0, nullptr);
+			if (f == INVALID_HANDLE_VALUE)
+				return false;
+			BY_HANDLE_FILE_INFORMATION info;
+			const bool result = !!GetFileInformationByHandle(f, &info);
+			if (result)
+			{
+				identity.timestamp = (uint64_t)info.ftLastWriteTime.dwLowDateTime;
+				identity.timestamp |= ((uint64_t)info.ftLastWriteTime.dwHighDateTime) << 32;
+				identity.size = (uint64_t)info.nFileSizeLow | ((uint64_t)info.nFileSizeHigh << 32);
+				identity.inode = (uint64_t)info.nFileIndexLow | ((uint64_t)info.nFileIndexHigh << 32);
+			}
+			CloseHandle(f);
+			return result;
+		}
+
 		namespace detail
 		{
 			string_vector enumerate_fs_items(const char *path, const bool files)
@@ -241,6 +263,7 @@ namespace cbl
 
 		bool copy_file(const char *existing_path, const char *new_path, copy_flags flags)
 		{
+			invalidate_metadata(new_path);
 			if (CopyFileA(existing_path, new_path, (!!(flags & overwrite)) ? FALSE : TRUE))
 			{
 				cbl::log_verbose("Copied file %s to %s, copy flags 0x%X", existing_path, new_path, flags);
@@ -275,7 +298,9 @@ namespace cbl
 
 		bool move_file(const char *existing_path, const char *new_path, copy_flags flags)
 		{
-			if (MoveFileExA(existing_path, new_path, MOVEFILE_WRITE_THROUGH | MOVEFILE_COPY_ALLOWED | ((!!(flags & overwrite)) ? 0 : MOVEFILE_REPLACE_EXISTING)))
+			invalidate_metadata(existing_path);
+			invalidate_metadata(new_path);
+			if (MoveFileExA(existing_path, new_path, MOVEFILE_WRITE_THROUGH | MOVEFILE_COPY_ALLOWED | ((!!(flags & overwrite)) ? MOVEFILE_REPLACE_EXISTING : 0)))
 			{
 				cbl::log_verbose("Moved file %s to %s, copy flags 0x%X", existing_path, new_path, flags);
 				if (!!(flags & maintain_timestamps))
@@ -307,8 +332,42 @@ namespace cbl
 			return false;
 		}
 
+		file_mapping::file_mapping(const char *path)
+		{
+			HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+			if (file == INVALID_HANDLE_VALUE)
+				return;
+			LARGE_INTEGER size;
+			if (GetFileSizeEx(file, &size) && size.QuadPart > 0)
+			{
+				handle = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+				if (handle)
+				{
+					ptr = (const uint8_t *)MapViewOfFile(handle, FILE_MAP_READ, 0, 0, 0);
+					if (ptr)
+						length = (size_t)size.QuadPart;
+					else
+					{
+						CloseHandle(handle);
+						handle = nullptr;
+					}
+				}
+			}
+			// The mapping object keeps the file open.
+			CloseHandle(file);
+		}
+
+		file_mapping::~file_mapping()
+		{
+			if (ptr)
+				UnmapViewOfFile(ptr);
+			if (handle)
+				CloseHandle(handle);
+		}
+
 		bool delete_file(const char *path)
 		{
+			invalidate_metadata(path);
 			if (DeleteFileA(path))
 			{
 				cbl::log_verbose("Deleted file %s", path);
@@ -321,6 +380,39 @@ namespace cbl
 			}
 		}
 
+		bool touch_file(const char *path)
+		{
+			invalidate_metadata(path);
+			HANDLE f = CreateFileA(path, FILE_WRITE_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, 0, nullptr);
+			if (f == INVALID_HANDLE_VALUE)
+			{
+				cbl::log_verbose("Failed to touch file %s, error: 0x%08X", path, GetLastError());
+				return false;
+			}
+			FILETIME now;
+			GetSystemTimeAsFileTime(&now);
+			const bool result = !!SetFileTime(f, nullptr, nullptr, &now);
+			CloseHandle(f);
+			return result;
+		}
+
+		bool set_modification_timestamp(const char *path, uint64_t stamp)
+		{
+			invalidate_metadata(path);
+			HANDLE f = CreateFileA(path, FILE_WRITE_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, 0, nullptr);
+			if (f == INVALID_HANDLE_VALUE)
+			{
+				cbl::log_verbose("Failed to set time stamp of file %s, error: 0x%08X", path, GetLastError());
+				return false;
+			}
+			FILETIME last_write;
+			last_write.dwLowDateTime = (DWORD)(stamp & 0xFFFFFFFF);
+			last_write.dwHighDateTime = (DWORD)(stamp >> 32);
+			const bool result = !!SetFileTime(f, nullptr, nullptr, &last_write);
+			CloseHandle(f);
+			return result;
+		}
+
 		void disinherit_stream(FILE *stream)
 		{
 			if (HANDLE h = (HANDLE)_get_osfhandle(_fileno(stream)))
@@ -437,27 +529,100 @@ namespace cbl
 		return kickoff;
 	}
 
-	int process::wait()
+	deferred_process process::start_deferred(
+		const string_vector &argv,
+		pipe_output_callback on_stderr,
+		pipe_output_callback on_stdout,
+		const std::vector<uint8_t> *stdin_buffer, void *environment)
 	{
-		MTR_SCOPE_I(__FILE__, "Wait for process", "handle", (uintptr_t)handle);
+		assert(!argv.empty());
+		// CreateProcess() takes a single command line, so quote the arguments the way CommandLineToArgvW() splits them.
+		std::string commandline;
+		for (auto &arg : argv)
+		{
+			if (!commandline.empty())
+				commandline += ' ';
+			if (!arg.empty() && arg.find_first_of(" \t\n\v\"") == std::string::npos)
+			{
+				commandline += arg;
+				continue;
+			}
+			commandline += '"';
+			size_t backslashes = 0;
+			for (char c : arg)
+			{
+				if (c == '\\')
+					++backslashes;
+				else
+				{
+					// Backslashes are only special when followed by a double quote.
+					if (c == '"')
+						commandline.append(backslashes + 1, '\\');
+					backslashes = 0;
+				}
+				commandline += c;
+			}
+			// Make sure the closing quote isn't escaped.
+			commandline.append(backslashes, '\\');
+			commandline += '"';
+		}
+		return start_deferred(commandline.c_str(), on_stderr, on_stdout, stdin_buffer, environment);
+	}
 
-		int exit_code = -1;
-		auto read_pipe_to_callback = [](HANDLE pipe[2], std::vector<uint8_t> &buffer, pipe_output_callback& cb)
+	namespace detail
+	{
+		// Hands whatever output is waiting in the pipe over to the callback, without blocking.
+		static void read_pipe_to_callback(HANDLE pipe, std::vector<uint8_t> &buffer, pipe_output_callback& cb)
 		{
-			if (pipe[pipe_read] != INVALID_HANDLE_VALUE)
+			if (pipe != INVALID_HANDLE_VALUE)
 			{
-				BOOL result = TRUE;
 				DWORD available = 0;
-				if (PeekNamedPipe(pipe[pipe_read], nullptr, 0, nullptr, &available, nullptr) && available > 0)
+				if (PeekNamedPipe(pipe, nullptr, 0, nullptr, &available, nullptr) && available > 0)
 				{
 					DWORD read;
 					buffer.resize(available);
-					if (ReadFile(pipe[pipe_read], buffer.data(), available, &read, nullptr))
+					if (ReadFile(pipe, buffer.data(), available, &read, nullptr))
 					{
 						cb(buffer.data(), read);
 					}
 				}
 			}
+		}
+
+		// Only the process itself is accounted for, not its children. Context switches aren't reported.
+		static void query_usage(HANDLE process, process_usage &usage)
+		{
+			auto to_usec = [](const FILETIME &t)
+			{
+				// In 100-nanosecond units.
+				return ((uint64_t(t.dwHighDateTime) << 32) | t.dwLowDateTime) / 10;
+			};
+			FILETIME creation, exit, kernel, user;
+			if (GetProcessTimes(process, &creation, &exit, &kernel, &user))
+			{
+				usage.user_usec = to_usec(user);
+				usage.system_usec = to_usec(kernel);
+			}
+			PROCESS_MEMORY_COUNTERS memory;
+			if (GetProcessMemoryInfo(process, &memory, sizeof(memory)))
+				usage.peak_rss_kb = memory.PeakWorkingSetSize / 1024;
+			IO_COUNTERS io;
+			if (GetProcessIoCounters(process, &io))
+			{
+				usage.blocks_in = io.ReadOperationCount;
+				usage.blocks_out = io.WriteOperationCount;
+			}
+		}
+	}
+
+	int process::wait()
+	{
+		MTR_SCOPE_I(__FILE__, "Wait for process", "handle", (uintptr_t)handle);
+
+		int exit_code = -1;
+		auto read_pipe_to_callback = [](HANDLE pipe[2], std::vector<uint8_t> &buffer, pipe_output_callback& cb)
+		{
+			detail::read_pipe_to_callback(pipe[pipe_read], buffer, cb);
 		};
 
 		std::vector<uint8_t> buffer;
@@ -482,6 +647,7 @@ namespace cbl
 			read_pipe_to_callback(out, buffer, on_out);
 		} while (result != WAIT_OBJECT_0 && result != WAIT_FAILED);
 		GetExitCodeProcess(handle, (LPDWORD)(&exit_code));
+		detail::query_usage(handle, usage);
 		
 		// Make sure to drain the pipes.
 		if (handle_count > 1)
@@ -492,12 +658,14 @@ namespace cbl
 		}
 
 		CloseHandle(handle);
+		handle = INVALID_HANDLE_VALUE;
 		auto safe_close_handles = [](HANDLE h[2])
 		{
 			if (h[pipe_write] != INVALID_HANDLE_VALUE)
 				CloseHandle(h[pipe_write]);
 			if (h[pipe_read] != INVALID_HANDLE_VALUE)
 				CloseHandle(h[pipe_read]);
+			h[pipe_write] = h[pipe_read] = INVALID_HANDLE_VALUE;
 		};
 		safe_close_handles(in);
 		safe_close_handles(out);
@@ -528,13 +696,75 @@ namespace cbl
 		safe_close_handles(err);
 	}
 
-	std::vector<int> process::wait_for_multiple(const std::vector<std::shared_ptr<process>>& processes)
+	void process::wait_async(std::shared_ptr<process> p, std::function<void(int exit_code)> on_exit)
 	{
-		std::vector<int> exit_codes;
-		// FIXME: This can be made to run much more concurrently than this with WaitForMultipleObjects.
-		for (auto p : processes)
+		// Waiting also drains the pipes, which takes a thread anyway, so give the process one of its own, as on Linux
+		// without pidfds.
+		std::thread([p, on_exit]() { on_exit(p->wait()); }).detach();
+	}
+
+	std::vector<int> process::wait_for_multiple(const std::vector<std::shared_ptr<process>>& processes,
+		process_exit_callback on_exit)
+	{
+		MTR_SCOPE_I(__FILE__, "Wait for processes", "count", processes.size());
+
+		std::vector<int> exit_codes(processes.size(), -1);
+		std::vector<size_t> waited;
+		bool keep_waiting = true;
+		for (size_t i = 0; i < processes.size() && keep_waiting; ++i)
+		{
+			auto &p = processes[i];
+			if (!p)
+			{
+				if (on_exit)
+					keep_waiting = on_exit(i, -1);
+			}
+			else if (p->handle != INVALID_HANDLE_VALUE)
+				waited.push_back(i);
+		}
+
+		std::vector<uint8_t> buffer;
+		std::vector<HANDLE> handles;
+		while (keep_waiting && !waited.empty())
 		{
-			exit_codes.push_back(p->wait());
+			// Clogged pipes may stop the processes from completing, so drain them in between short waits.
+			for (size_t i : waited)
+			{
+				auto &p = processes[i];
+				detail::read_pipe_to_callback(p->err[pipe_read], buffer, p->on_err);
+				detail::read_pipe_to_callback(p->out[pipe_read], buffer, p->on_out);
+			}
+
+			// Only so many handles may be waited upon at once, so larger groups take turns.
+			const size_t count = std::min<size_t>(waited.size(), MAXIMUM_WAIT_OBJECTS);
+			handles.clear();
+			for (size_t i = 0; i < count; ++i)
+				handles.push_back(processes[waited[i]]->handle);
+
+			DWORD result = WaitForMultipleObjects((DWORD)count, handles.data(), FALSE, 10);
+			if (result >= WAIT_OBJECT_0 && result < WAIT_OBJECT_0 + count)
+			{
+				// The process has finished, so this won't block for long, and takes care of the remaining output.
+				const size_t index = waited[result - WAIT_OBJECT_0];
+				waited.erase(waited.begin() + (result - WAIT_OBJECT_0));
+				exit_codes[index] = processes[index]->wait();
+				if (on_exit)
+					keep_waiting = on_exit(index, exit_codes[index]);
+			}
+			else if (result == WAIT_FAILED)
+			{
+				cbl::log_verbose("Waiting for process group failed, error: 0x%08X", GetLastError());
+				// Fall back to waiting for the processes one by one.
+				for (size_t index : waited)
+				{
+					exit_codes[index] = processes[index]->wait();
+					if (on_exit && !on_exit(index, exit_codes[index]))
+						break;
+				}
+				break;
+			}
+			else if (waited.size() > count)
+				std::rotate(waited.begin(), waited.begin() + count, waited.end());
 		}
 		return exit_codes;
 	}
@@ -562,6 +792,12 @@ namespace cbl
 		return s;
 	}
 
+	void process::exec(const string_vector &argv)
+	{
+		// _exec() only emulates this by spawning a new process and exiting.
+		cbl::error("Failed to execute %s, replacing the process image is not supported on Windows", argv[0].c_str());
+	}
+
 	void process::wait_for_pid(uint32_t pid)
 	{
 		if (HANDLE h = OpenProcess(SYNCHRONIZE, FALSE, (DWORD)pid))
@@ -570,6 +806,178 @@ namespace cbl
 		}
 	}
 
+	namespace jobserver
+	{
+		static HANDLE semaphore = nullptr;
+		// Signalled whenever the implicit slot is given back, to wake up a thread waiting for the semaphore.
+		static HANDLE wake_event = nullptr;
+		static std::atomic<bool> implicit_taken{ false };
+		static bool inherited = false;
+		// See notify_when_available().
+		static std::function<void()> token_watch;
+		static std::mutex token_watch_mutex;
+		static HANDLE token_watch_handle = nullptr;
+
+		void initialize(uint32_t slots)
+		{
+			wake_event = CreateEventA(nullptr, FALSE, FALSE, nullptr);
+			if (!wake_event)
+			{
+				cbl::warning("Failed to create jobserver event, error code: %d", GetLastError());
+				return;
+			}
+
+			// Make on Windows uses a named semaphore, passed as --jobserver-auth=<name>.
+			constexpr const char key[] = "--jobserver-auth=";
+			const char *makeflags = getenv("MAKEFLAGS");
+			const char *auth = nullptr;
+			for (const char *p = makeflags ? strstr(makeflags, key) : nullptr; p; p = strstr(p + 1, key))
+				auth = p + sizeof(key) - 1;
+			if (auth)
+			{
+				std::string name(auth, strcspn(auth, " "));
+				semaphore = OpenSemaphoreA(SEMAPHORE_ALL_ACCESS, FALSE, name.c_str());
+				if (semaphore)
+				{
+					cbl::log_verbose("Using jobserver inherited through MAKEFLAGS");
+					inherited = true;
+					return;
+				}
+				cbl::warning("Jobserver advertised in MAKEFLAGS (%s) is not accessible, ignoring it. Hint: prefix the recipe line invoking cppbuild with '+'", name.c_str());
+			}
+
+			if (slots == 0)
+				return;
+			// Our own slot is implicit.
+			std::string name = "cppbuild_jobserver_" + std::to_string(process::get_current_pid());
+			semaphore = CreateSemaphoreA(nullptr, slots - 1, std::max(1u, slots - 1), name.c_str());
+			if (!semaphore)
+			{
+				cbl::warning("Failed to start a jobserver with %u slots, error code: %d", slots, GetLastError());
+				return;
+			}
+
+			// Keep whatever else make has passed down.
+			std::string flags = makeflags ? makeflags : "";
+			if (!flags.empty())
+				flags += ' ';
+			flags += "-j" + std::to_string(slots) + " --jobserver-auth=" + name;
+			SetEnvironmentVariableA("MAKEFLAGS", flags.c_str());
+			cbl::log_verbose("Started jobserver with %u slots", slots);
+		}
+
+		bool is_active() { return semaphore != nullptr; }
+
+		bool is_inherited() { return inherited; }
+
+		bool try_acquire(token &t)
+		{
+			if (!semaphore || !implicit_taken.exchange(true))
+			{
+				t = implicit_token;
+				return true;
+			}
+
+			DWORD result = WaitForSingleObject(semaphore, 0);
+			if (result == WAIT_TIMEOUT)
+				return false;
+			if (result == WAIT_OBJECT_0)
+				// Semaphore slots are indistinguishable.
+				t = 0;
+			else
+			{
+				cbl::error("Failed to acquire a jobserver token, error code: %d", GetLastError());
+				// FIXME: Treat this as fatal? Going on merely oversubscribes.
+				t = no_token;
+			}
+			return true;
+		}
+
+		token acquire()
+		{
+			if (!semaphore)
+				return implicit_token;
+			for (;;)
+			{
+				if (!implicit_taken.exchange(true))
+					return implicit_token;
+
+				HANDLE handles[] = { semaphore, wake_event };
+				DWORD result = WaitForMultipleObjects(2, handles, FALSE, INFINITE);
+				if (result == WAIT_OBJECT_0)
+					// Semaphore slots are indistinguishable.
+					return 0;
+				if (result != WAIT_OBJECT_0 + 1)
+				{
+					cbl::error("Failed to acquire a jobserver token, error code: %d", GetLastError());
+					// FIXME: Treat this as fatal? Going on merely oversubscribes.
+					return no_token;
+				}
+			}
+		}
+
+		static void fire_token_watch()
+		{
+			std::lock_guard<std::mutex> _(token_watch_mutex);
+			std::function<void()> callback;
+			std::swap(callback, token_watch);
+			if (callback)
+				callback();
+		}
+
+		static VOID CALLBACK on_token_available(PVOID, BOOLEAN)
+		{
+			// Satisfying the wait took a slot off the semaphore, so give it back for try_acquire() to take.
+			ReleaseSemaphore(semaphore, 1, nullptr);
+			fire_token_watch();
+		}
+
+		void notify_when_available(std::function<void()> callback)
+		{
+			// Waits registered once still need unregistering, which also waits for their callback to return.
+			const bool cancel = !callback;
+			HANDLE previous;
+			{
+				std::lock_guard<std::mutex> _(token_watch_mutex);
+				previous = token_watch_handle;
+				token_watch_handle = nullptr;
+				token_watch = std::move(callback);
+			}
+			if (previous)
+				UnregisterWaitEx(previous, INVALID_HANDLE_VALUE);
+			if (cancel)
+				return;
+
+			HANDLE handle = nullptr;
+			if (semaphore && !RegisterWaitForSingleObject(&handle, semaphore, on_token_available, nullptr, INFINITE, WT_EXECUTEONLYONCE))
+				cbl::log_verbose("Failed to wait for the jobserver semaphore, error code: %d", GetLastError());
+			if (!handle)
+			{
+				// Nothing to wait for, or no way to.
+				fire_token_watch();
+				return;
+			}
+			std::lock_guard<std::mutex> _(token_watch_mutex);
+			token_watch_handle = handle;
+		}
+
+		void release(token t)
+		{
+			if (t == no_token)
+				return;
+			if (t == implicit_token)
+			{
+				if (semaphore)
+				{
+					implicit_taken = false;
+					SetEvent(wake_event);
+				}
+			}
+			else if (!ReleaseSemaphore(semaphore, 1, nullptr))
+				cbl::error("Failed to release a jobserver token, error code: %d", GetLastError());
+		}
+	}
+
 	namespace win64
 	{
 		namespace registry
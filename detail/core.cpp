@@ -499,6 +499,17 @@ void rotate_traces(bool append_to_current)
 #endif	// MTR_ENABLED
 }
 
+void shutdown_traces()
+{
+#if MTR_ENABLED
+	if (cbl::detail::trace_file_stream)
+	{
+		mtr_shutdown();
+		cbl::detail::trace_file_stream = nullptr;
+	}
+#endif	// MTR_ENABLED
+}
+
 void rotate_logs(bool append_to_current)
 {
 	using namespace cbl;
@@ -45,6 +45,7 @@ enum class error_code : int
 
 	failed_writing_response_file,
 	failed_launching_compiler_process,
+	failed_exporting_cache,
 };
 
 namespace cppbuild
@@ -132,6 +133,8 @@ extern void print_usage(const char *argv0);
 extern void discover_toolchains(toolchain_map& toolchains);
 
 extern void rotate_traces(bool append_to_current);
+// Terminates and closes the trace ahead of time, for when exit handlers won't get to run.
+extern void shutdown_traces();
 extern void rotate_logs(bool append_to_current);
 
 extern void init_process_group();
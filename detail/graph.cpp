@@ -26,13 +26,18 @@ SOFTWARE.
 #include "../cbl.h"
 #include "detail.h"
 
+#include <condition_variable>
+#include <deque>
+#include <limits>
 #include <mutex>
+#include <queue>
 #include <sstream>
 
 using namespace graph;
 
 using cache_map_key = std::pair<target, configuration>;
-using timestamp_cache_key = std::pair<std::string, std::string>;
+// Fingerprint of the source path and the compiler response.
+using timestamp_cache_key = cbl::fingerprint;
 
 bool operator==(const cache_map_key &a, const cache_map_key &b)
 {
@@ -56,15 +61,17 @@ namespace std
 	{
 		size_t operator()(const timestamp_cache_key &k) const
 		{
-			using namespace cbl;
-			hash<string> string_hasher;
-			return combine_hash(string_hasher(k.first), string_hasher(k.second));
+			// It's a good hash already.
+			return (size_t)k.lo;
 		}
 	};
 }
 
-using timestamp_cache = std::unordered_map<timestamp_cache_key, dependency_timestamp_vector>;
-using timestamp_cache_entry = timestamp_cache::value_type;
+union magic
+{
+	char c[4];
+	uint32_t i;
+};
 
 template <typename T>
 static inline void atomic_max(std::atomic<T>& max, T const& value) noexcept
@@ -79,7 +86,7 @@ static inline void cull_input(cull_context &ctx, graph::action &action, std::sha
 	uint64_t input_timestamp = input ? input->get_oldest_output_timestamp() : stamp_if_missing;
 	
 	const bool input_exists = input_timestamp > 0;
-	const bool older_than_graph_root = !input || input_timestamp < ctx.root_timestamp;
+	const bool older_than_graph_root = input_timestamp < ctx.root_timestamp;
 	const bool output_exists = ctx.self_timestamp > 0;
 
 	// Only cull inputs if we exist.
@@ -92,8 +99,9 @@ static inline void cull_input(cull_context &ctx, graph::action &action, std::sha
 	}
 	else
 	{
+		// Inputs that have been culled on their own may still be newer than us, e.g. objects after a failed link.
 		cbl::log_debug("Bumping self timestamp from input type %d %s for action %s (self stamp %" PRId64 ", input stamp %" PRId64 ", root stamp %" PRId64 ")",
-			input->type, input->outputs[0].c_str(), action.outputs[0].c_str(), ctx.self_timestamp.load(), input_timestamp, ctx.root_timestamp);
+			input ? input->type : -1, input ? input->outputs[0].c_str() : "already culled", action.outputs[0].c_str(), ctx.self_timestamp.load(), input_timestamp, ctx.root_timestamp);
 		// Keep own timestamp up to date with inputs.
 		if (input_timestamp == 0 || ctx.self_timestamp == 0)
 			ctx.self_timestamp = 0;
@@ -102,6 +110,8 @@ static inline void cull_input(cull_context &ctx, graph::action &action, std::sha
 	}
 };
 
+static void cull_action(build_context& bctx, std::shared_ptr<graph::action>& action, uint64_t root_timestamp);
+
 static void prune_inputs(graph::action_vector &inputs)
 {
 	MTR_SCOPE_FUNC();
@@ -116,18 +126,27 @@ static void prune_inputs(graph::action_vector &inputs)
 template<bool is_linking>
 static bool internal_cull_cpp_action(build_context &bctx, cull_context &ictx, cpp_action &action)
 {
-	/*uint64_t root_timestamp = action.get_oldest_output_timestamp();
-	cull_context ictx{ root_timestamp, root_timestamp };*/
+	// Our own outputs' time stamp, before any of the inputs get a chance to bump it.
+	const uint64_t own_timestamp = ictx.self_timestamp;
 
 	const auto rf_path = action.response_file.c_str();
 	const auto rf_timestamp = cbl::fs::get_modification_timestamp(rf_path);
-	if (ictx.self_timestamp < rf_timestamp)
+	const bool rf_newer = ictx.self_timestamp < rf_timestamp;
+	if (action.dependencies_unknown)
+	{
+		// Without known dependencies we can't tell whether we're up to date, so compile and capture them.
+		cbl::log_debug("Unknown dependencies for ACTION type %d %s", action.type, action.outputs[0].c_str());
+		ictx.self_timestamp = 0;
+	}
+	else if (rf_newer)
 	{
 		// Response file is newer, which means that compilation flags have changed.
 		cbl::log_debug("Response file newer than product for ACTION type %d %s (%d inputs remaining; self=%" PRIu64 ", rf=%" PRIu64 ")", action.type, action.outputs[0].c_str(), action.inputs.size(), ictx.self_timestamp.load(), rf_timestamp);
 		ictx.self_timestamp = rf_timestamp;
 	}
-	else
+
+	// Objects are judged against their own inputs, so they may still be culled when only the link needs redoing.
+	if (!action.dependencies_unknown && (is_linking || !rf_newer))
 	{
 		decltype(action.inputs) backup_inputs;
 		if (is_linking)
@@ -140,13 +159,16 @@ static bool internal_cull_cpp_action(build_context &bctx, cull_context &ictx, cp
 		cbl::parallel_for([&](uint32_t i)
 		{
 			auto& input = action.inputs[i];
-			cull_action(bctx, input, ictx.root_timestamp);
-			cull_input(ictx, action, input, ~0u);
+			// Objects are their own reference point; sources are judged against our object.
+			const uint64_t input_timestamp = input->get_oldest_output_timestamp();
+			cull_action(bctx, input, is_linking ? input_timestamp : ictx.root_timestamp);
+			cull_input(ictx, action, input, input_timestamp);
 		},
 			action.inputs.size(), 1);
 		prune_inputs(action.inputs);
 
-		if (is_linking && !action.inputs.empty() && action.inputs.size() < backup_inputs.size())
+		const bool outdated = ictx.self_timestamp == 0 || ictx.self_timestamp > own_timestamp;
+		if (is_linking && (!action.inputs.empty() || outdated) && action.inputs.size() < backup_inputs.size())
 		{
 			for (auto &bi : backup_inputs)
 			{
@@ -174,7 +196,8 @@ static bool internal_cull_cpp_action(build_context &bctx, cull_context &ictx, cp
 		}
 	}
 
-	if (action.inputs.empty() && ictx.root_timestamp != 0)
+	// We're only up to date if we exist and none of the inputs turned out to be newer than us.
+	if (action.inputs.empty() && own_timestamp != 0 && ictx.self_timestamp != 0 && ictx.self_timestamp <= own_timestamp)
 	{
 		cbl::log_debug("Culling ACTION type %d %s (%d inputs remaining)", action.type, action.outputs[0].c_str(), action.inputs.size());
 		return true;
@@ -186,16 +209,21 @@ static bool internal_cull_cpp_action(build_context &bctx, cull_context &ictx, cp
 	}
 }
 
+static uint64_t get_content_timestamp(const char *path);
+static void restat_output(const char *path);
+static uint64_t get_build_timestamp(const char *path, uint64_t timestamp);
+static void record_usage(const action &action, const cbl::process_usage &usage);
+
 static int internal_exec_cpp_action(cbl::deferred_process process, const action &action)
 {
 	if (process)
 	{
 		std::string outputs = cbl::jsonify(cbl::join(action.outputs, " "));
-		cbl::info("%s", ("Building " + outputs).c_str());
 		MTR_SCOPE_FUNC_S("outputs", outputs.c_str());
 		if (auto spawned = process())
 		{
 			int exit_code = spawned->wait();
+			record_usage(action, spawned->usage);
 			if (exit_code != 0 && g_options.fatal_errors.val.as_bool)
 				cbl::fatal(exit_code, "Building %s failed with code %d", outputs.c_str(), exit_code);
 			return exit_code;
@@ -209,12 +237,44 @@ static bool cull_test_link(build_context &context, cull_context &ictx, action &a
 	return internal_cull_cpp_action<true>(context, ictx, static_cast<cpp_action &>(action));
 }
 
+// With --restat, objects may have gotten their old time stamps back since culling, so look at the file system again.
+static bool is_link_still_outdated(const cpp_action &action)
+{
+	const uint64_t own_timestamp = cbl::fs::query_modification_timestamp(action.outputs[0].c_str());
+	if (own_timestamp == 0 || cbl::fs::query_modification_timestamp(action.response_file.c_str()) > own_timestamp)
+		return true;
+	for (auto &input : action.inputs)
+	{
+		for (auto &output : input->outputs)
+		{
+			const uint64_t input_timestamp = cbl::fs::query_modification_timestamp(output.c_str());
+			if (input_timestamp == 0 || input_timestamp > own_timestamp)
+				return true;
+		}
+	}
+	return false;
+}
+
+static cbl::deferred_process schedule_link(build_context &context, const action &action)
+{
+	const auto& as_cpp_action = static_cast<const cpp_action&>(action);
+	if (g_options.restat.val.as_bool && !is_link_still_outdated(as_cpp_action))
+	{
+		cbl::log_verbose("Objects of %s turned out unchanged, skipping link", action.outputs[0].c_str());
+		return nullptr;
+	}
+	return context.tc.schedule_linker(context, as_cpp_action.response_file.c_str());
+}
+
 static int exec_link(build_context &context, const action &action)
 {
 	const auto& as_cpp_action = static_cast<const cpp_action&>(action);
 	MTR_SCOPE_FUNC_S("response_file", cbl::jsonify(as_cpp_action.response_file.c_str()).c_str());
 
-	return internal_exec_cpp_action(context.tc.schedule_linker(context, as_cpp_action.response_file.c_str()), action);
+	auto process = schedule_link(context, action);
+	if (!process && g_options.restat.val.as_bool)
+		return 0;
+	return internal_exec_cpp_action(process, action);
 }
 
 static bool cull_test_compile(build_context &context, cull_context &ictx, action &action)
@@ -222,16 +282,14 @@ static bool cull_test_compile(build_context &context, cull_context &ictx, action
 	return internal_cull_cpp_action<false>(context, ictx, static_cast<cpp_action &>(action));
 }
 
-static int exec_compile(build_context &context, const action &action)
+static cbl::deferred_process schedule_compile(build_context &context, const action &action)
 {
 	const auto& as_cpp_action = static_cast<const cpp_action&>(action);
-	MTR_SCOPE_FUNC_S("response_file", cbl::jsonify(as_cpp_action.response_file.c_str()).c_str());
-
 	if (action.inputs.size() == 0)
 	{
 		assert(0 != action.get_oldest_output_timestamp() && "No inputs and the output does not exist");
 		// We are now a dummy action that only exists to gather preexisting objects for linking.
-		return 0;
+		return nullptr;
 	}
 
 	assert(action.outputs.size() == 1);
@@ -242,10 +300,33 @@ static int exec_compile(build_context &context, const action &action)
 	// FIXME: Find a more appropriate place for this mkdir.
 	cbl::fs::mkdir(cbl::path::get_directory(action.outputs[0].c_str()).c_str(), true);
 
-	return internal_exec_cpp_action(
-		context.tc.schedule_compiler(context, as_cpp_action.response_file.c_str()),
-		action
-	);
+	// Make sure we know the hash of the object we are about to overwrite.
+	if (g_options.restat.val.as_bool)
+		get_content_timestamp(action.outputs[0].c_str());
+
+	return context.tc.schedule_compiler(context, as_cpp_action.response_file.c_str(), action);
+}
+
+static int complete_compile(build_context &context, const action &action, int exit_code)
+{
+	if (exit_code == 0)
+	{
+		context.tc.capture_dependencies_for_cpptu(context, action);
+		if (g_options.restat.val.as_bool)
+			restat_output(action.outputs[0].c_str());
+	}
+	return exit_code;
+}
+
+static int exec_compile(build_context &context, const action &action)
+{
+	const auto& as_cpp_action = static_cast<const cpp_action&>(action);
+	MTR_SCOPE_FUNC_S("response_file", cbl::jsonify(as_cpp_action.response_file.c_str()).c_str());
+
+	auto process = schedule_compile(context, action);
+	if (!process)
+		return 0;
+	return complete_compile(context, action, internal_exec_cpp_action(process, action));
 }
 
 static bool cull_test_source(build_context& context, cull_context &ictx, action& action)
@@ -270,83 +351,861 @@ static bool cull_test_include(build_context& context, cull_context &ictx, action
 	return false;
 }
 
+// Asynchronous counterpart of the execution handler, for built-in actions that boil down to running a single process.
+// The schedule handler prepares the process (a null one means there is nothing to run), and the completion handler,
+// if any, post-processes its exit code.
+using action_schedule_handler = cbl::deferred_process (*)(build_context &, const action &);
+using action_complete_handler = int (*)(build_context &, const action &, int exit_code);
+
 struct action_handlers
 {
 	action_cull_test_handler cull;
 	action_execute_handler exec;
+	action_schedule_handler schedule;
+	action_complete_handler complete;
 };
 static std::vector<action_handlers> g_action_handlers =
 {
-	action_handlers{ cull_test_link, exec_link },
-	action_handlers{ cull_test_compile, exec_compile },
-	action_handlers{ cull_test_source, nullptr },
-	action_handlers{ cull_test_include, nullptr }
+	action_handlers{ cull_test_link, exec_link, schedule_link, nullptr },
+	action_handlers{ cull_test_compile, exec_compile, schedule_compile, complete_compile },
+	action_handlers{ cull_test_source, nullptr, nullptr, nullptr },
+	action_handlers{ cull_test_include, nullptr, nullptr, nullptr }
 };
 
-using task_set_ptr = std::shared_ptr<enki::ITaskSet>;
+static int execute_action(build_context &ctx, graph::action &action)
+{
+	assert((action.inputs.size() > 0 || nullptr != g_action_handlers[action.type].exec) && "Nothing to do for this action");
+
+	std::string outputs = cbl::jsonify(cbl::join(action.outputs, " "));
+	cbl::info("%s", ("Building " + outputs).c_str());
+	MTR_SCOPE_FUNC_S("outputs", outputs.c_str());
+
+	int exit_code = g_action_handlers[action.type].exec(ctx, action);
+	// Outputs may have been written by an external process, so forget whatever we knew about them.
+	for (auto &o : action.outputs)
+		cbl::fs::invalidate_metadata(o.c_str());
+	if (exit_code != 0 && g_options.fatal_errors.val.as_bool)
+		cbl::fatal(exit_code, "Building %s failed with code %d", outputs.c_str(), exit_code);
+	return exit_code;
+}
 
-task_set_ptr enqueue_build_tasks(build_context& ctx, std::shared_ptr<graph::action> root);
+// Wall times of past action executions in microseconds, keyed on the first output of the action. Kept per target
+// next to the timestamp cache, and used to start the actions on the critical path first.
+struct duration_history
+{
+	std::unordered_map<std::string, uint64_t> durations;
+	// Estimate for actions without any history.
+	uint64_t fallback;
+	bool dirty = false;
+};
 
-class action_exec_task : public enki::ITaskSet
+static constexpr magic duration_magic = { 'C', 'B', 'D', 'H' };
+// Increment this counter every time the duration history binary format changes.
+static constexpr uint32_t duration_version = 1;
+// Assumed duration of any action, before anything has been recorded.
+static constexpr uint64_t default_duration_usec = 1000000;
+
+static std::unordered_map<cache_map_key, duration_history> duration_map;
+static std::mutex duration_mutex;
+
+static std::string get_duration_history_path(const target &target, const configuration& cfg)
+{
+	using namespace cbl;
+	using namespace cbl::path;
+	return join(get_cppbuild_cache_path(), join(get_platform_str(cfg.second.platform), join(target.first, "durations.bin")));
+}
+
+// Must be called with duration_mutex held.
+static duration_history& find_or_create_duration_history(const build_context &ctx)
+{
+	auto key = std::make_pair(ctx.trg, ctx.cfg);
+	auto it = duration_map.find(key);
+	if (it != duration_map.end())
+		return it->second;
+
+	MTR_SCOPE_FUNC();
+	duration_history& history = duration_map[key];
+	std::string path = get_duration_history_path(ctx.trg, ctx.cfg);
+	if (FILE *f = fopen(path.c_str(), "rb"))
+	{
+		magic m;
+		uint64_t v, count;
+		const uint64_t expected_version = ((uint64_t)duration_version << 32) | (uint64_t)cbl::get_host_platform();
+		if (1 == fread(&m, sizeof(m), 1, f) && m.i == duration_magic.i
+			&& 1 == fread(&v, sizeof(v), 1, f) && v == expected_version
+			&& 1 == fread(&count, sizeof(count), 1, f))
+		{
+			std::string output;
+			for (uint64_t i = 0; i < count; ++i)
+			{
+				uint32_t length;
+				uint64_t usec;
+				if (1 != fread(&length, sizeof(length), 1, f))
+					break;
+				output.resize(length);
+				if (length != fread(&output[0], 1, length, f) || 1 != fread(&usec, sizeof(usec), 1, f))
+					break;
+				history.durations[output] = usec;
+			}
+		}
+		else
+			cbl::log_debug("[DurationSer] Header mismatch in %s, discarding", path.c_str());
+		fclose(f);
+	}
+
+	uint64_t sum = 0;
+	for (auto &d : history.durations)
+		sum += d.second;
+	history.fallback = history.durations.empty() ? default_duration_usec : sum / history.durations.size();
+	return history;
+}
+
+static void record_duration(duration_history &history, const action &action, uint64_t usec)
+{
+	std::lock_guard<std::mutex> _(duration_mutex);
+	auto it = history.durations.find(action.outputs[0]);
+	// Smooth out the noise a bit.
+	if (it == history.durations.end())
+		history.durations.emplace(action.outputs[0], usec);
+	else
+		it->second = (it->second + usec) / 2;
+	history.dirty = true;
+}
+
+static void save_duration_histories()
+{
+	MTR_SCOPE_FUNC();
+	std::lock_guard<std::mutex> _(duration_mutex);
+	for (auto &pair : duration_map)
+	{
+		auto& history = pair.second;
+		if (!history.dirty)
+			continue;
+		std::string path = get_duration_history_path(pair.first.first, pair.first.second);
+		cbl::fs::mkdir(cbl::path::get_directory(path.c_str()).c_str(), true);
+		FILE *f = fopen(path.c_str(), "wb");
+		if (!f)
+		{
+			cbl::log_verbose("Failed to open duration history for writing to %s", path.c_str());
+			continue;
+		}
+		const uint64_t version = ((uint64_t)duration_version << 32) | (uint64_t)cbl::get_host_platform();
+		const uint64_t count = history.durations.size();
+		fwrite(&duration_magic, sizeof(duration_magic), 1, f);
+		fwrite(&version, sizeof(version), 1, f);
+		fwrite(&count, sizeof(count), 1, f);
+		for (auto &d : history.durations)
+		{
+			const uint32_t length = (uint32_t)d.first.length();
+			fwrite(&length, sizeof(length), 1, f);
+			fwrite(d.first.data(), 1, length, f);
+			fwrite(&d.second, sizeof(d.second), 1, f);
+		}
+		fclose(f);
+		history.dirty = false;
+	}
+}
+
+// With --usage-summary, the resources consumed by every compiler and linker invocation are kept for the summary printed
+// at the end of the build.
+struct usage_record
+{
+	std::string output;
+	cbl::process_usage usage;
+};
+
+static std::vector<usage_record> usage_records;
+static std::mutex usage_mutex;
+
+static std::string describe_usage(const cbl::process_usage &usage)
+{
+	char buffer[256];
+	snprintf(buffer, sizeof(buffer),
+		"user %.3fs, sys %.3fs, peak RSS %" PRIu64 " KiB, blocks in %" PRIu64 " out %" PRIu64 ", context switches %" PRIu64 " voluntary %" PRIu64 " involuntary",
+		(double)usage.user_usec * 1e-6, (double)usage.system_usec * 1e-6, usage.peak_rss_kb,
+		usage.blocks_in, usage.blocks_out, usage.voluntary_context_switches, usage.involuntary_context_switches);
+	return buffer;
+}
+
+static void record_usage(const action &action, const cbl::process_usage &usage)
+{
+	if (g_options.usage_summary.val.as_int32 <= 0)
+		return;
+	std::lock_guard<std::mutex> _(usage_mutex);
+	usage_records.push_back(usage_record{ action.outputs[0], usage });
+}
+
+// minitrace events carry a single argument at most, and MTR_FINISH none at all, so the usage is attached as a string.
+#if MTR_ENABLED
+	#define MTR_FINISH_S(c, n, id, aname, astrval) internal_mtr_raw_event_arg(c, n, 'F', (void *)(id), MTR_ARG_TYPE_STRING_COPY, aname, (void *)(astrval))
+#else
+	#define MTR_FINISH_S(c, n, id, aname, astrval) MTR_FINISH(c, n, id)
+#endif
+
+// With --content-hashes, sources and headers are given the time stamp of the last actual change to their contents,
+// rather than their modification time, so that touching a file without changing it (e.g. by switching git branches
+// back and forth) does not make its dependents outdated. Hashes are kept per host, and a file is only rehashed when
+// its identity (modification time, size and inode) has changed since.
+struct content_record
+{
+	cbl::fs::file_identity identity;
+	cbl::fingerprint hash;
+	// Effective time stamp, i.e. the modification time as of the last change to the contents.
+	uint64_t stamp;
+	// Set once the identity has been checked during the current build session.
+	bool verified;
+};
+
+static constexpr magic content_magic = { 'C', 'B', 'C', 'H' };
+// Increment this counter every time the content hash binary format changes.
+static constexpr uint32_t content_version = 1;
+
+static std::unordered_map<std::string, content_record> content_map;
+static std::mutex content_mutex;
+static bool content_loaded = false;
+static bool content_dirty = false;
+
+static std::string get_content_hashes_path()
+{
+	return cbl::path::join(cbl::path::get_cppbuild_cache_path(), "content_hashes.bin");
+}
+
+// Must be called with content_mutex held.
+static void load_content_hashes()
+{
+	if (content_loaded)
+		return;
+	content_loaded = true;
+
+	MTR_SCOPE_FUNC();
+	std::string path = get_content_hashes_path();
+	if (FILE *f = fopen(path.c_str(), "rb"))
+	{
+		magic m;
+		uint64_t v, count;
+		const uint64_t expected_version = ((uint64_t)content_version << 32) | (uint64_t)cbl::get_host_platform();
+		if (1 == fread(&m, sizeof(m), 1, f) && m.i == content_magic.i
+			&& 1 == fread(&v, sizeof(v), 1, f) && v == expected_version
+			&& 1 == fread(&count, sizeof(count), 1, f))
+		{
+			std::string file;
+			for (uint64_t i = 0; i < count; ++i)
+			{
+				uint32_t length;
+				content_record record{};
+				if (1 != fread(&length, sizeof(length), 1, f))
+					break;
+				file.resize(length);
+				if (length != fread(&file[0], 1, length, f)
+					|| 1 != fread(&record.identity, sizeof(record.identity), 1, f)
+					|| 1 != fread(&record.hash, sizeof(record.hash), 1, f)
+					|| 1 != fread(&record.stamp, sizeof(record.stamp), 1, f))
+					break;
+				content_map[file] = record;
+			}
+		}
+		else
+			cbl::log_debug("[ContentSer] Header mismatch in %s, discarding", path.c_str());
+		fclose(f);
+	}
+}
+
+static void save_content_hashes()
+{
+	MTR_SCOPE_FUNC();
+	std::lock_guard<std::mutex> _(content_mutex);
+	if (!content_dirty)
+		return;
+	std::string path = get_content_hashes_path();
+	cbl::fs::mkdir(cbl::path::get_directory(path.c_str()).c_str(), true);
+	FILE *f = fopen(path.c_str(), "wb");
+	if (!f)
+	{
+		cbl::log_verbose("Failed to open content hashes for writing to %s", path.c_str());
+		return;
+	}
+	const uint64_t version = ((uint64_t)content_version << 32) | (uint64_t)cbl::get_host_platform();
+	const uint64_t count = content_map.size();
+	fwrite(&content_magic, sizeof(content_magic), 1, f);
+	fwrite(&version, sizeof(version), 1, f);
+	fwrite(&count, sizeof(count), 1, f);
+	for (auto &c : content_map)
+	{
+		const uint32_t length = (uint32_t)c.first.length();
+		fwrite(&length, sizeof(length), 1, f);
+		fwrite(c.first.data(), 1, length, f);
+		fwrite(&c.second.identity, sizeof(c.second.identity), 1, f);
+		fwrite(&c.second.hash, sizeof(c.second.hash), 1, f);
+		fwrite(&c.second.stamp, sizeof(c.second.stamp), 1, f);
+	}
+	fclose(f);
+	content_dirty = false;
+}
+
+// Files may have changed between build sessions, so their identities need checking again.
+static void reset_content_verification()
+{
+	std::lock_guard<std::mutex> _(content_mutex);
+	for (auto &c : content_map)
+		c.second.verified = false;
+}
+
+static cbl::fingerprint hash_file_contents(const char *path)
+{
+	MTR_SCOPE_FUNC_S("path", path);
+	cbl::fs::file_mapping mapping(path);
+	// Empty files are never mapped.
+	return mapping.is_valid() ? cbl::compute_fingerprint(mapping.data(), mapping.size()) : cbl::compute_fingerprint("", 0);
+}
+
+// Brings the record of the file up to date with the file system, rehashing it if its identity has changed. Returns false
+// if the file does not exist.
+static bool verify_content_record(const char *path, content_record &record)
+{
+	content_record previous;
+	bool known = false;
+	{
+		std::lock_guard<std::mutex> _(content_mutex);
+		load_content_hashes();
+		auto it = content_map.find(path);
+		if (it != content_map.end())
+		{
+			if (it->second.verified)
+			{
+				record = it->second;
+				return true;
+			}
+			previous = it->second;
+			known = true;
+		}
+	}
+
+	// Stat and hash outside of the lock. Should another thread race us to it, it will have seen the same result anyway.
+	if (!cbl::fs::query_file_identity(path, record.identity))
+		return false;
+	record.verified = true;
+	const bool rehash = !known || previous.identity != record.identity;
+	if (rehash)
+	{
+		record.hash = hash_file_contents(path);
+		// Touched, but not actually changed.
+		const bool unchanged = known && previous.hash == record.hash;
+		record.stamp = unchanged ? previous.stamp : record.identity.timestamp;
+		if (unchanged)
+			cbl::log_debug("Contents of %s unchanged, keeping time stamp %" PRIu64, path, record.stamp);
+	}
+	else
+	{
+		record.hash = previous.hash;
+		record.stamp = previous.stamp;
+	}
+
+	std::lock_guard<std::mutex> _(content_mutex);
+	content_map[path] = record;
+	content_dirty |= rehash;
+	return true;
+}
+
+static uint64_t get_content_timestamp(const char *path)
+{
+	content_record record;
+	return verify_content_record(path, record) ? record.stamp : 0;
+}
+
+// Rehashes a freshly rebuilt output, and if its contents have not changed, gives it back its previous time stamp, so that
+// whatever depends on it does not get rebuilt, either.
+static void restat_output(const char *path)
+{
+	content_record previous;
+	bool known = false;
+	{
+		std::lock_guard<std::mutex> _(content_mutex);
+		load_content_hashes();
+		auto it = content_map.find(path);
+		if (it != content_map.end())
+		{
+			previous = it->second;
+			known = true;
+		}
+	}
+
+	content_record record;
+	if (!cbl::fs::query_file_identity(path, record.identity))
+		return;
+	record.hash = hash_file_contents(path);
+	record.stamp = record.identity.timestamp;
+	record.verified = true;
+	if (known && previous.hash == record.hash && previous.identity.timestamp < record.identity.timestamp)
+	{
+		if (cbl::fs::set_modification_timestamp(path, previous.identity.timestamp))
+		{
+			// The record keeps the actual build time as the stamp, for get_build_timestamp().
+			cbl::log_verbose("%s turned out unchanged, restoring its time stamp", path);
+			record.identity.timestamp = previous.identity.timestamp;
+		}
+	}
+
+	std::lock_guard<std::mutex> _(content_mutex);
+	content_map[path] = record;
+	content_dirty = true;
+}
+
+namespace graph
+{
+	void restamp_output(const char *path)
+	{
+		content_record previous;
+		bool known = false;
+		{
+			std::lock_guard<std::mutex> _(content_mutex);
+			load_content_hashes();
+			auto it = content_map.find(path);
+			if (it != content_map.end())
+			{
+				previous = it->second;
+				known = true;
+			}
+		}
+
+		content_record record;
+		if (!cbl::fs::query_file_identity(path, record.identity))
+			return;
+		record.hash = known && previous.identity == record.identity ? previous.hash : hash_file_contents(path);
+		// As with restat_output(), the modification time stays put, and the record carries the build time.
+		record.stamp = std::max(record.identity.timestamp, cbl::time::now());
+		record.verified = true;
+
+		std::lock_guard<std::mutex> _(content_mutex);
+		content_map[path] = record;
+		content_dirty = true;
+	}
+};
+
+// Time stamp that an output was actually built at, which restat_output() or restamp_output() may have hidden behind an
+// older one.
+static uint64_t get_build_timestamp(const char *path, uint64_t timestamp)
+{
+	std::lock_guard<std::mutex> _(content_mutex);
+	load_content_hashes();
+	auto it = content_map.find(path);
+	if (it != content_map.end() && it->second.identity.timestamp == timestamp)
+		return std::max(timestamp, it->second.stamp);
+	return timestamp;
+}
+
+// Time stamp by which the output of the given action type is judged.
+static uint64_t get_output_timestamp(action::action_type type, const char *path)
+{
+	if (g_options.content_hashes.val.as_bool && (type == (action::action_type)cpp_action::source || type == (action::action_type)cpp_action::include))
+		return get_content_timestamp(path);
+	return cbl::fs::get_modification_timestamp(path);
+}
+
+// Executes actions on a fixed set of workers, one per scheduler thread. Every action keeps an atomic count of its
+// inputs that are still pending execution, and is released into the ready queue once that count hits zero. There are
+// no nested waits and no per-action task objects; scheduling cost is proportional to the number of edges.
+// Actions that run a process don't occupy a worker while it runs: the process is reaped asynchronously, and its exit
+// is queued back to the workers, so the number of processes in flight is limited by the job count, not threads.
+// An action is only started once a jobserver token is held for it, so that no worker ever blocks waiting for one.
+// Ready actions are started in the order of the longest estimated path from them to the root, based on the durations
+// recorded in previous builds.
+class action_executor : public enki::ITaskSet
 {
-protected:
-	build_context ctx;
-	std::shared_ptr<graph::action> action;
 public:
-	cbl::deferred_process process;
-	int exit_code = -1;
+	using job = std::function<void(uint32_t index)>;
 
-	action_exec_task(build_context &context, std::shared_ptr<graph::action> action_)
-		: enki::ITaskSet(1, 1)
+	explicit action_executor(build_context &context)
+		: enki::ITaskSet(cbl::scheduler.GetNumTaskThreads(), 1)
 		, ctx(context)
-		, action(action_)
+		, history([&context]() -> duration_history*
+			{
+				std::lock_guard<std::mutex> _(duration_mutex);
+				return &find_or_create_duration_history(context);
+			}())
+		, max_in_flight(g_options.jobs.val.as_int32 > 0 ? (uint32_t)g_options.jobs.val.as_int32
+			// With an inherited jobserver, its tokens are the limit.
+			: (cbl::jobserver::is_inherited() ? std::numeric_limits<uint32_t>::max() : cbl::scheduler.GetNumTaskThreads()))
 	{}
-			
-	void ExecuteRange(enki::TaskSetPartition range, uint32_t threadnum) override
+
+	// Adds the executable part of the graph, i.e. the actions with execution handlers that are reachable from the
+	// root through other such actions. Must be called at most once, before run().
+	void add_graph(const flat_graph &flat)
+	{
+		MTR_SCOPE_FUNC();
+		assert(actions.empty() && "Graph must be added first");
+		if (flat.size() == 0)
+			return;
+
+		// Consumers have higher ids than their inputs, so a single descending sweep finds everything reachable.
+		const flat_graph::node_id none = std::numeric_limits<flat_graph::node_id>::max();
+		std::vector<flat_graph::node_id> index(flat.size(), none);
+		auto is_executable = [&flat](flat_graph::node_id n) { return nullptr != g_action_handlers[flat.types[n]].exec; };
+		const flat_graph::node_id root = (flat_graph::node_id)flat.size() - 1;
+		if (is_executable(root))
+			index[root] = 0;
+		for (flat_graph::node_id n = root + 1; n-- > 0;)
+		{
+			if (index[n] == none)
+				continue;
+			for (auto i = flat.inputs_begin(n); i != flat.inputs_end(n); ++i)
+			{
+				if (index[*i] == none && is_executable(*i))
+					index[*i] = 0;
+			}
+		}
+		for (flat_graph::node_id n = 0; n < flat.size(); ++n)
+		{
+			if (index[n] != none)
+			{
+				index[n] = (flat_graph::node_id)actions.size();
+				actions.push_back(flat.actions[n]);
+			}
+		}
+		graph_size = (uint32_t)actions.size();
+
+		// Build the consumer lists in CSR form, and count the pending inputs.
+		std::vector<uint32_t> initially_ready;
+		pending.reset(new std::atomic<uint32_t>[graph_size]);
+		consumer_offsets.assign(graph_size + 1, 0);
+		for (flat_graph::node_id n = 0; n < flat.size(); ++n)
+		{
+			if (index[n] == none)
+				continue;
+			uint32_t count = 0;
+			for (auto i = flat.inputs_begin(n); i != flat.inputs_end(n); ++i)
+			{
+				if (index[*i] != none)
+				{
+					++consumer_offsets[index[*i] + 1];
+					++count;
+				}
+			}
+			pending[index[n]] = count;
+			if (count == 0)
+				initially_ready.push_back(index[n]);
+		}
+		for (uint32_t i = 0; i < graph_size; ++i)
+			consumer_offsets[i + 1] += consumer_offsets[i];
+		consumer_ids.resize(consumer_offsets[graph_size]);
+		std::vector<uint32_t> fill(consumer_offsets.begin(), consumer_offsets.end() - 1);
+		for (flat_graph::node_id n = 0; n < flat.size(); ++n)
+		{
+			if (index[n] == none)
+				continue;
+			for (auto i = flat.inputs_begin(n); i != flat.inputs_end(n); ++i)
+			{
+				if (index[*i] != none)
+					consumer_ids[fill[index[*i]]++] = index[n];
+			}
+		}
+
+		// Consumers come after their inputs, so walk backwards to accumulate the remaining path lengths.
+		priorities.resize(graph_size);
+		for (uint32_t i = graph_size; i-- > 0;)
+		{
+			uint64_t longest_remaining = 0;
+			for (uint32_t c = consumer_offsets[i]; c < consumer_offsets[i + 1]; ++c)
+				longest_remaining = std::max(longest_remaining, priorities[consumer_ids[c]]);
+			priorities[i] = estimate_duration(*actions[i]) + longest_remaining;
+		}
+		if (graph_size > 0)
+			cbl::log_verbose("Estimated critical path: %3.4fs", (double)*std::max_element(priorities.begin(), priorities.end()) * 1e-6);
+		for (auto r : initially_ready)
+			ready_actions.emplace(priorities[r], r);
+	}
+
+	// Adds a standalone action whose inputs need no executing, so it is ready right away. May be called from jobs.
+	void add_action(action_ptr action)
 	{
-		assert((action->inputs.size() > 0 || nullptr != g_action_handlers[action->type].exec) && "Nothing to do for this action");
-		assert(range.end - range.start == 1 && "Cannot handle ranges yet");
+		{
+			const uint64_t priority = estimate_duration(*action);
+			std::lock_guard<std::mutex> _(mutex);
+			ready_actions.emplace(priority, (uint32_t)actions.size());
+			priorities.push_back(priority);
+			actions.push_back(action);
+		}
+		ready_cv.notify_one();
+	}
 
-		std::string outputs = cbl::jsonify(cbl::join(action->outputs, " "));
+	// Adds count jobs, which are run by the workers alongside the actions, e.g. to generate more actions.
+	void add_jobs(uint32_t count, job body)
+	{
+		assert(!job_body && "Only one kind of job is supported");
+		job_body = body;
+		for (uint32_t i = 0; i < count; ++i)
+			ready_jobs.push_back(i);
+	}
 
-		exit_code = dispatch_subtasks_and_wait(outputs.c_str());
-		if (exit_code == 0)
+	// Runs everything to completion and returns the first non-zero exit code, if any. Actions depending on a failed
+	// one are not executed.
+	int run()
+	{
+		MTR_SCOPE_FUNC();
+		if (!ready_actions.empty() || !ready_jobs.empty())
 		{
-			cbl::info("%s", ("Building " + outputs).c_str());
-			MTR_SCOPE_FUNC_S("outputs", outputs.c_str());
+			cbl::scheduler.AddTaskSetToPipe(this);
+			cbl::scheduler.WaitforTask(this);
+			// The callback refers to us, and might be running even if it has already disarmed itself.
+			cbl::jobserver::notify_when_available(nullptr);
+			if (has_spare_token)
+				cbl::jobserver::release(spare_token);
+		}
+		return exit_code;
+	}
 
-			exit_code = g_action_handlers[action->type].exec(ctx, *action);
-			if (exit_code != 0 && g_options.fatal_errors.val.as_bool)
-				cbl::fatal(exit_code, "Building %s failed with code %d", outputs.c_str(), exit_code);
+	uint32_t get_executed_action_count() const { return executed; }
+
+	void ExecuteRange(enki::TaskSetPartition, uint32_t) override
+	{
+		// Jobs may wait for other tasks (e.g. in cbl::parallel_for()), and enkiTS runs pending tasks while waiting,
+		// including partitions of this very task set. A nested worker loop would only exit once nothing is running,
+		// which never happens while the job suspended beneath it counts as running, so leave it to the outer loop.
+		static thread_local bool in_worker_loop = false;
+		if (in_worker_loop)
+			return;
+		in_worker_loop = true;
+		cbl::scoped_guard reset([]() { in_worker_loop = false; });
+
+		for (;;)
+		{
+			enum { do_job, do_start, do_finish } what;
+			uint32_t index;
+			int result = 0;
+			uint64_t usec = 0;
+			cbl::process_usage usage{};
+			action_ptr action;
+			cbl::jobserver::token token = cbl::jobserver::no_token;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				// If nothing is ready and nothing is running, nothing can become ready anymore, save for a token.
+				while (finished.empty() && !can_start() && ready_jobs.empty() && (running > 0 || !ready_actions.empty()))
+				{
+					if (is_waiting_for_token() && !token_watch_armed)
+					{
+						// The jobserver may call back right away, so not under the lock.
+						token_watch_armed = true;
+						lock.unlock();
+						cbl::jobserver::notify_when_available([this]()
+						{
+							{
+								std::lock_guard<std::mutex> _(mutex);
+								token_watch_armed = false;
+							}
+							ready_cv.notify_all();
+						});
+						lock.lock();
+					}
+					else
+						ready_cv.wait(lock);
+				}
+				// Retire finished processes first, as they may release more work.
+				if (!finished.empty())
+				{
+					what = do_finish;
+					index = finished.front().index;
+					result = finished.front().exit_code;
+					usec = finished.front().usec;
+					usage = finished.front().usage;
+					finished.pop_front();
+				}
+				else if (can_start())
+				{
+					what = do_start;
+					MTR_COUNTER(__FILE__, "Critical path remaining (ms)", ready_actions.top().first / 1000);
+					index = ready_actions.top().second;
+					ready_actions.pop();
+					token = spare_token;
+					has_spare_token = false;
+					++running;
+					++in_flight;
+				}
+				else if (!ready_jobs.empty())
+				{
+					what = do_job;
+					index = ready_jobs.front();
+					ready_jobs.pop_front();
+					++running;
+				}
+				else
+					break;
+				if (what != do_job)
+					action = actions[index];
+			}
+
+			switch (what)
+			{
+			case do_job:
+				job_body(index);
+				{
+					std::lock_guard<std::mutex> _(mutex);
+					--running;
+				}
+				ready_cv.notify_all();
+				break;
+			case do_start:
+				if (start_action(index, *action, token, result, usec))
+					finish_action(index, *action, result, usec, nullptr);
+				break;
+			case do_finish:
+				finish_action(index, *action, result, usec, &usage);
+				break;
+			}
 		}
 	}
 
-protected:
-	int dispatch_subtasks_and_wait(const char *outputs)
+private:
+	// Takes a token for the next action to start, if there is one. Must be called under the lock.
+	bool can_start()
 	{
-		MTR_SCOPE_FUNC_S("dependents", outputs);
-		// FIXME: Creating a ton of task sets is excessive, we should create one task set and feed it arrays instead.
-		std::vector<task_set_ptr> subtasks;
-		subtasks.reserve(action->inputs.size());
-		for (auto i : action->inputs)
+		if (ready_actions.empty() || in_flight >= max_in_flight)
+			return false;
+		if (!has_spare_token)
+			has_spare_token = cbl::jobserver::try_acquire(spare_token);
+		return has_spare_token;
+	}
+
+	bool is_waiting_for_token() const { return !ready_actions.empty() && in_flight < max_in_flight && !has_spare_token; }
+
+	uint64_t estimate_duration(const graph::action &action)
+	{
+		// Consume-only actions take no time.
+		if (action.inputs.empty() && nullptr != g_action_handlers[action.type].schedule)
+			return 0;
+		std::lock_guard<std::mutex> _(duration_mutex);
+		auto it = history->durations.find(action.outputs[0]);
+		return it != history->durations.end() ? it->second : history->fallback;
+	}
+
+	// Returns true if the action has been executed synchronously, with its exit code in result and its wall time in
+	// usec (0 if nothing was run). Otherwise, its process has been launched and will be retired once it exits. Either
+	// way, the token is given back once the action no longer needs it.
+	bool start_action(uint32_t index, graph::action &action, cbl::jobserver::token token, int &result, uint64_t &usec)
+	{
+		assert((action.inputs.size() > 0 || nullptr != g_action_handlers[action.type].exec) && "Nothing to do for this action");
+		auto schedule = g_action_handlers[action.type].schedule;
+		if (!schedule)
 		{
-			if (auto subtask = enqueue_build_tasks(ctx, i))
-				subtasks.push_back(subtask);
+			const uint64_t start = cbl::time::now();
+			result = execute_action(ctx, action);
+			usec = cbl::time::duration_usec(start, cbl::time::now());
+			cbl::jobserver::release(token);
+			return true;
+		}
+
+		auto process = schedule(ctx, action);
+		if (!process)
+		{
+			cbl::jobserver::release(token);
+			result = 0;
+			return true;
+		}
+		std::string outputs = cbl::jsonify(cbl::join(action.outputs, " "));
+		cbl::info("%s", ("Building " + outputs).c_str());
+		MTR_START(__FILE__, "Building", &action);
+		const uint64_t start = cbl::time::now();
+		auto spawned = process();
+		if (!spawned)
+		{
+			MTR_FINISH(__FILE__, "Building", &action);
+			cbl::jobserver::release(token);
+			result = (int)error_code::failed_launching_compiler_process;
+			return true;
 		}
-		// Issue the subtasks.
-		for (auto& t : subtasks)
-			cbl::scheduler.AddTaskSetToPipe(t.get());
-		// Wait for them to complete.
-		int dep_exit_code = 0;
-		for (auto& t : subtasks)
+		cbl::process::wait_async(spawned, [this, index, token, start, spawned](int exit_code)
 		{
-			cbl::scheduler.WaitforTask(t.get());
+			// Give the slot back right away, without waiting for a worker to retire the action.
+			cbl::jobserver::release(token);
+			const uint64_t usec = cbl::time::duration_usec(start, cbl::time::now());
+			{
+				std::lock_guard<std::mutex> _(mutex);
+				finished.push_back(completion{ index, exit_code, usec, spawned->usage });
+			}
+			ready_cv.notify_one();
+		});
+		return false;
+	}
+
+	// usage is given for actions whose process has been launched by start_action(), and null otherwise.
+	void finish_action(uint32_t index, graph::action &action, int result, uint64_t usec, const cbl::process_usage *usage)
+	{
+		auto &handlers = g_action_handlers[action.type];
+		if (usage)
+		{
+			MTR_FINISH_S(__FILE__, "Building", &action, "usage", describe_usage(*usage).c_str());
+			record_usage(action, *usage);
+			if (handlers.complete)
+				result = handlers.complete(ctx, action, result);
+			// Outputs have been written by an external process, so forget whatever we knew about them.
+			for (auto &o : action.outputs)
+				cbl::fs::invalidate_metadata(o.c_str());
+			if (result != 0 && g_options.fatal_errors.val.as_bool)
+				cbl::fatal(result, "Building %s failed with code %d", cbl::jsonify(cbl::join(action.outputs, " ")).c_str(), result);
+		}
+
+		if (result == 0 && usec > 0)
+			record_duration(*history, action, usec);
+
+		std::vector<uint32_t> released;
+		if (result == 0 && index < graph_size)
+		{
+			for (uint32_t i = consumer_offsets[index]; i < consumer_offsets[index + 1]; ++i)
+			{
+				if (--pending[consumer_ids[i]] == 0)
+					released.push_back(consumer_ids[i]);
+			}
+		}
+
+		{
+			std::lock_guard<std::mutex> _(mutex);
+			++executed;
 			// Propagate the first non-success exit code.
-			if (dep_exit_code == 0)
-				dep_exit_code = std::static_pointer_cast<action_exec_task>(t)->exit_code;
+			if (exit_code == 0)
+				exit_code = result;
+			for (auto r : released)
+				ready_actions.emplace(priorities[r], r);
+			--running;
+			--in_flight;
 		}
-		return dep_exit_code;
+		ready_cv.notify_all();
 	}
+
+	build_context ctx;
+	// Actions added as part of the graph come first, followed by standalone ones, which have no consumers.
+	std::vector<action_ptr> actions;
+	uint32_t graph_size = 0;
+	std::unique_ptr<std::atomic<uint32_t>[]> pending;
+	std::vector<uint32_t> consumer_offsets;
+	std::vector<uint32_t> consumer_ids;
+	job job_body;
+	duration_history *history;
+	const uint32_t max_in_flight;
+	// Token taken by can_start() for the next action to start.
+	cbl::jobserver::token spare_token = cbl::jobserver::no_token;
+	bool has_spare_token = false;
+	bool token_watch_armed = false;
+
+	std::mutex mutex;
+	std::condition_variable ready_cv;
+	std::deque<uint32_t> ready_jobs;
+	// Estimated remaining path length, paired with the action index.
+	std::priority_queue<std::pair<uint64_t, uint32_t>> ready_actions;
+	// Estimated path length from each action to the root, in microseconds.
+	std::vector<uint64_t> priorities;
+	struct completion
+	{
+		uint32_t index;
+		int exit_code;
+		uint64_t usec;
+		cbl::process_usage usage;
+	};
+	// Actions whose processes have exited.
+	std::deque<completion> finished;
+	// Actions and jobs that have been started and not yet retired.
+	uint32_t running = 0;
+	// Actions that have been started and not yet retired.
+	uint32_t in_flight = 0;
+	uint32_t executed = 0;
+	int exit_code = 0;
 };
 
 static void cull_action(build_context& bctx, std::shared_ptr<graph::action>& action, uint64_t root_timestamp)
@@ -360,131 +1219,278 @@ static void cull_action(build_context& bctx, std::shared_ptr<graph::action>& act
 	};
 	static_assert(sizeof(types) / sizeof(types[0]) == action::cpp_actions_end, "Missing string for action type");
 	MTR_SCOPE_S(__FILE__,
-		action->type <= cpp_action::include ? types[action->type] : "Cull: action",
+		action->type <= (graph::action::action_type)cpp_action::include ? types[action->type] : "Cull: action",
 		"outputs[0]",
 		cbl::jsonify(action->outputs[0].c_str()).c_str());
-	cull_context ictx{ action->get_oldest_output_timestamp(), root_timestamp };
+	uint64_t own_timestamp = action->get_oldest_output_timestamp();
+	if (action->type == (graph::action::action_type)cpp_action::compile && own_timestamp != 0
+		&& (g_options.restat.val.as_bool || g_options.token_hashes.val.as_bool))
+	{
+		// Judge objects whose time stamps got restored or kept by their actual build times, lest they get rebuilt
+		// forever.
+		own_timestamp = get_build_timestamp(action->outputs[0].c_str(), own_timestamp);
+		root_timestamp = std::max(root_timestamp, own_timestamp);
+	}
+	cull_context ictx{ own_timestamp, root_timestamp };
 	if (g_action_handlers[action->type].cull && g_action_handlers[action->type].cull(bctx, ictx, *action))
 		action = nullptr;
 }
 
-task_set_ptr enqueue_build_tasks(build_context& ctx, std::shared_ptr<graph::action> root)
+static constexpr magic cache_magic = { 'C', 'B', 'T', 'C' };
+// Increment this counter every time the cache binary format changes. 
+static constexpr uint32_t cache_version = 5;
+
+// The cache file is laid out to be memory-mapped and queried in place, without any parsing. It consists of a header,
+// an open addressing hash index, the entries, their dependencies, and a table of deduplicated, null-terminated
+// strings, which everything else refers to by offset.
+struct cache_file_header
 {
-	MTR_SCOPE_FUNC();
-	if (!root)	// Empty graph, nothing to build.
-		return nullptr;
-	if (nullptr == g_action_handlers[root->type].exec)
-		return nullptr;
-	return std::make_shared<action_exec_task>(ctx, root);
-}
+	magic m;
+	uint32_t entry_count;
+	uint64_t version;
+	// Power of two, greater than the entry count.
+	uint32_t bucket_count;
+	uint32_t dependency_count;
+	uint32_t strings_size;
+	uint32_t reserved;
+};
 
-union magic
+struct cache_file_entry
 {
-	char c[4];
-	uint32_t i;
+	timestamp_cache_key key;
+	uint32_t source;
+	// Only stored with --debug-cache-keys, the empty string otherwise.
+	uint32_t response;
+	uint32_t first_dependency;
+	uint32_t dependency_count;
+	// Hash of the preprocessed tokens with --token-hashes, all zeros otherwise.
+	cbl::fingerprint tokens;
 };
 
-static constexpr magic cache_magic = { 'C', 'B', 'T', 'C' };
-// Increment this counter every time the cache binary format changes. 
-static constexpr uint32_t cache_version = 2;
+struct cache_file_dependency
+{
+	uint64_t stamp;
+	uint32_t path;
+	uint32_t reserved;
+};
+
+static timestamp_cache_key make_cache_key(const std::string &source, const char *response)
+{
+	return cbl::compute_fingerprint(response, strlen(response), cbl::compute_fingerprint(source.data(), source.length()));
+}
+
+// Fingerprints are long enough for collisions to be practically impossible, but a mismatching source path (or response,
+// if stored) is cheap to catch, so don't take chances.
+static bool verify_cache_key(const char *stored_source, const char *stored_response, const std::string &source, const char *response)
+{
+	if (source == stored_source && (!*stored_response || 0 == strcmp(stored_response, response)))
+		return true;
+	cbl::warning("Dependency cache key collision for TU %s (stored for %s), treating it as a miss", source.c_str(), stored_source);
+	return false;
+}
+
+// Points into a mapped cache file. Buckets hold entry indices plus one, so that 0 means an empty bucket.
+struct cache_file_view
+{
+	const cache_file_header *header = nullptr;
+	const uint32_t *buckets = nullptr;
+	const cache_file_entry *entries = nullptr;
+	const cache_file_dependency *dependencies = nullptr;
+	const char *strings = nullptr;
 
-typedef size_t(*serializer)(void *ptr, size_t size, size_t nmemb, FILE *stream);
+	const char *string_at(uint32_t offset) const { return offset < header->strings_size ? strings + offset : ""; }
 
-static inline size_t fwrite_wrapper(void *ptr, size_t size, size_t nmemb, FILE *stream)
+	// Returns the index of the entry, or -1 if there is none.
+	int64_t find(const timestamp_cache_key &key) const
+	{
+		if (!header)
+			return -1;
+		const uint32_t mask = header->bucket_count - 1;
+		uint32_t b = (uint32_t)key.lo & mask;
+		for (uint32_t probe = 0; probe < header->bucket_count && buckets[b] != 0; ++probe, b = (b + 1) & mask)
+		{
+			const uint32_t index = buckets[b] - 1;
+			if (index < header->entry_count && entries[index].key == key)
+				return index;
+		}
+		return -1;
+	}
+
+	bool is_valid_range(const cache_file_entry &e) const
+	{
+		return e.first_dependency <= header->dependency_count && e.dependency_count <= header->dependency_count - e.first_dependency;
+	}
+};
+
+// Dependency cache of a single target. Entries persisted by the previous build are queried in place from the mapped
+// file, and only the ones inserted during this session are materialized.
+struct timestamp_cache
 {
-	return fwrite(const_cast<void*>(ptr), size, nmemb, stream);
+	struct changed_entry
+	{
+		std::string source;
+		// Only kept with --debug-cache-keys.
+		std::string response;
+		dependency_timestamp_vector deps;
+		cbl::fingerprint tokens;
+	};
+
+	// Changed entries are striped across shards by key, so that concurrently scanned translation units rarely contend.
+	// A shard's lock also guards the discarded flags of the mapped entries whose keys fall into it.
+	struct shard
+	{
+		std::mutex mutex;
+		std::unordered_map<timestamp_cache_key, changed_entry> changed;
+	};
+	static constexpr uint32_t shard_count = 16;
+
+	shard shards[shard_count];
+	// Only ever replaced when saving, which does not overlap with builds.
+	std::shared_ptr<cbl::fs::file_mapping> mapping;
+	cache_file_view view;
+	// Mapped entries that have turned out stale or have been superseded. Bytes rather than bits, so that each shard can
+	// write its own without racing the others.
+	std::vector<uint8_t> discarded;
+	// Set if some mapped entries have turned out stale, or some changed ones could not be journaled.
+	std::atomic_bool dirty{ false };
+	std::mutex journal_mutex;
+	FILE *journal = nullptr;
+	uint64_t journal_size = 0;
+
+	shard &get_shard(const timestamp_cache_key &key) { return shards[key.hi % shard_count]; }
 };
 
-template <serializer serializer, void(* on_success)(const timestamp_cache_key &key, const char *path, uint64_t stamp) = nullptr>
-static void serialize_cache_items(timestamp_cache& cache, FILE *stream)
+static bool map_cache_file(timestamp_cache &cache, const char *path)
 {
 	MTR_SCOPE_FUNC();
-	magic m = cache_magic;
-	std::hash<std::string> hasher;
-	if (1 == serializer(&m, sizeof(m), 1, stream) && m.i == cache_magic.i)
+	auto mapping = std::make_shared<cbl::fs::file_mapping>(path);
+	if (!mapping->is_valid())
+		return false;
+
+	const uint8_t *data = mapping->data();
+	const auto *header = (const cache_file_header *)data;
+	const uint64_t expected_version = ((uint64_t)cache_version << 32) | (uint64_t)cbl::get_host_platform();
+	if (mapping->size() < sizeof(*header) || header->m.i != cache_magic.i)
 	{
-		const uint64_t expected_version = ((uint64_t)cache_version << 32) | (uint64_t)cbl::get_host_platform();
-		uint64_t v = expected_version;
-		if (1 == serializer(&v, sizeof(v), 1, stream) && v == expected_version)
-		{
-			uint32_t length;
-			auto key_it = cache.begin();
-			std::string str;
-			timestamp_cache_key key;
-			uint64_t stamp;
+		cbl::log_debug("[CacheSer] Magic number mismatch (expected %08X)", cache_magic.i);
+		return false;
+	}
+	if (header->version != expected_version)
+	{
+		cbl::log_debug("[CacheSer] Version number mismatch (expected %" PRIu64 ", got %" PRIu64 ")", expected_version, header->version);
+		return false;
+	}
+	const uint64_t expected_size = sizeof(*header)
+		+ (uint64_t)header->bucket_count * sizeof(uint32_t)
+		+ (uint64_t)header->entry_count * sizeof(cache_file_entry)
+		+ (uint64_t)header->dependency_count * sizeof(cache_file_dependency)
+		+ header->strings_size;
+	if (header->bucket_count < 2 || 0 != (header->bucket_count & (header->bucket_count - 1))
+		|| header->bucket_count <= header->entry_count
+		|| header->strings_size == 0 || expected_size != mapping->size() || data[mapping->size() - 1] != 0)
+	{
+		cbl::log_debug("[CacheSer] Malformed cache file %s", path);
+		return false;
+	}
 
-			auto serialize_str = [stream](std::string& str) -> bool
-			{
-				uint32_t length = str.length();
-				bool success = (1 == serializer(&length, sizeof(length), 1, stream));
-				if (success)
-				{
-					str.resize(length);
-					success = length == serializer(const_cast<char *>(str.data()), 1, length, stream);
-					if (success)
-					{
-						str.push_back(0);
-						str.resize(length);
-					}
-				}
-				return success;
-			};
+	cache_file_view view;
+	view.header = header;
+	view.buckets = (const uint32_t *)(header + 1);
+	view.entries = (const cache_file_entry *)(view.buckets + header->bucket_count);
+	view.dependencies = (const cache_file_dependency *)(view.entries + header->entry_count);
+	view.strings = (const char *)(view.dependencies + header->dependency_count);
+
+	cache.mapping = mapping;
+	cache.view = view;
+	cache.discarded.assign(header->entry_count, 0);
+	return true;
+}
 
-			size_t key_count = cache.size();
-			if (1 == serializer(&key_count, sizeof(key_count), 1, stream))
-			{
-				bool success;
-				do
-				{
-					if (key_it != cache.end())
-					{
-						key = key_it++->first;
-					}
-					success = serialize_str(key.first) && serialize_str(key.second);
-					if (success)
-					{
-						auto& vec = cache[key];
-						length = vec.size();
-						success = 1 == serializer(&length, sizeof(length), 1, stream);
-						if (success)
-						{
-							vec.resize(length);
-							for (uint32_t i = 0; success && i < length; ++i)
-							{
-								success = serialize_str(vec[i].first);
-								if (success)
-								{
-									success = 1 == serializer(&vec[i].second, sizeof(vec[i].second), 1, stream);
-									if (success)
-									{
-										if (on_success)
-											on_success(key, vec[i].first.c_str(), vec[i].second);
-									}
-									else
-										cbl::log_debug("[CacheSer] Failed to serialize value time stamp at index %d, key %s@%x", i, key.first.c_str(), hasher(key.second));
-								}
-								else
-									cbl::log_debug("[CacheSer] Failed to serialize value string at index %d, key %s@%x", i, key.first.c_str(), hasher(key.second));
-							}
-						}
-						else
-							cbl::log_debug("[CacheSer] Failed to serialize value vector length for key %s@%x", key.first.c_str(), hasher(key.second));
-					}
-					else
-						cbl::log_debug("[CacheSer] Failed to serialize key string");
-					if (key_count-- <= 1)
-						break;
-				} while (success);
-			}
-			else
-				cbl::log_debug("[CacheSer] Failed to read cache key count");
+// Lays out a cache file in memory.
+class cache_file_writer
+{
+public:
+	cache_file_writer()
+	{
+		// Offset 0 is the empty string, which also guarantees a terminated table.
+		intern("");
+	}
+
+	template <typename dependency_accessor>
+	void add(const timestamp_cache_key &key, const char *source, const char *response, const cbl::fingerprint &tokens, uint32_t dependency_count, dependency_accessor get)
+	{
+		cache_file_entry e;
+		e.key = key;
+		e.tokens = tokens;
+		e.source = intern(source);
+		e.response = intern(g_options.debug_cache_keys.val.as_bool ? response : "");
+		e.first_dependency = (uint32_t)dependencies.size();
+		e.dependency_count = dependency_count;
+		for (uint32_t i = 0; i < dependency_count; ++i)
+		{
+			std::pair<const char *, uint64_t> d = get(i);
+			dependencies.push_back(cache_file_dependency{ d.second, intern(d.first), 0 });
 		}
-		else
-			cbl::log_debug("[CacheSer] Version number mismatch (expected %d, got %d)", cache_version, v);
+		entries.push_back(e);
 	}
-	else
-		cbl::log_debug("[CacheSer] Magic number mismatch (expected %08X, got %08X)", cache_magic.i, m.i);
-}
+
+	std::vector<uint8_t> finish() const
+	{
+		MTR_SCOPE_FUNC();
+		cache_file_header header;
+		header.m = cache_magic;
+		header.entry_count = (uint32_t)entries.size();
+		header.version = ((uint64_t)cache_version << 32) | (uint64_t)cbl::get_host_platform();
+		// Keep the load factor at or below one half.
+		header.bucket_count = 2;
+		while (header.bucket_count < 2 * entries.size())
+			header.bucket_count <<= 1;
+		header.dependency_count = (uint32_t)dependencies.size();
+		header.strings_size = (uint32_t)strings.size();
+		header.reserved = 0;
+
+		std::vector<uint32_t> buckets(header.bucket_count, 0);
+		const uint32_t mask = header.bucket_count - 1;
+		for (uint32_t i = 0; i < header.entry_count; ++i)
+		{
+			uint32_t b = (uint32_t)entries[i].key.lo & mask;
+			while (buckets[b] != 0)
+				b = (b + 1) & mask;
+			buckets[b] = i + 1;
+		}
+
+		std::vector<uint8_t> image;
+		auto append = [&image](const void *data, size_t size)
+		{
+			image.insert(image.end(), (const uint8_t *)data, (const uint8_t *)data + size);
+		};
+		image.reserve(sizeof(header) + buckets.size() * sizeof(buckets[0]) + entries.size() * sizeof(entries[0])
+			+ dependencies.size() * sizeof(dependencies[0]) + strings.size());
+		append(&header, sizeof(header));
+		append(buckets.data(), buckets.size() * sizeof(buckets[0]));
+		append(entries.data(), entries.size() * sizeof(entries[0]));
+		append(dependencies.data(), dependencies.size() * sizeof(dependencies[0]));
+		append(strings.data(), strings.size());
+		return image;
+	}
+
+private:
+	uint32_t intern(const char *s)
+	{
+		auto it = string_offsets.find(s);
+		if (it != string_offsets.end())
+			return it->second;
+		const uint32_t offset = (uint32_t)strings.size();
+		strings.append(s, strlen(s) + 1);
+		string_offsets.emplace(s, offset);
+		return offset;
+	}
+
+	std::unordered_map<std::string, uint32_t> string_offsets;
+	std::string strings;
+	std::vector<cache_file_entry> entries;
+	std::vector<cache_file_dependency> dependencies;
+};
 
 static std::string get_cache_path(const target &target, const configuration& cfg)
 {
@@ -493,6 +1499,183 @@ static std::string get_cache_path(const target &target, const configuration& cfg
 	return join(get_cppbuild_cache_path(), join(get_platform_str(cfg.second.platform), join(target.first, "timestamps.bin")));
 }
 
+// New and updated entries are appended to a journal as they are inserted, so that they survive the build getting
+// killed (e.g. by cbl::fatal()). The journal is replayed on top of the cache file on load, and compacted into it once
+// it outgrows it. Each record is prefixed with its size and a checksum, and replay stops at the first torn one.
+static constexpr magic journal_magic = { 'C', 'B', 'T', 'J' };
+
+struct journal_record_header
+{
+	uint32_t size;
+	uint32_t checksum;
+};
+
+static std::string get_journal_path(const target &target, const configuration& cfg)
+{
+	return cbl::path::join(cbl::path::get_directory(get_cache_path(target, cfg).c_str()), "timestamps.journal");
+}
+
+static void serialize_journal_record(std::vector<uint8_t> &record, const timestamp_cache_key &key, const timestamp_cache::changed_entry &entry)
+{
+	auto append = [&record](const void *data, size_t size)
+	{
+		record.insert(record.end(), (const uint8_t *)data, (const uint8_t *)data + size);
+	};
+	auto append_str = [&append](const std::string &str)
+	{
+		const uint32_t length = (uint32_t)str.length();
+		append(&length, sizeof(length));
+		append(str.data(), length);
+	};
+
+	record.resize(sizeof(journal_record_header));
+	append(&key, sizeof(key));
+	append_str(entry.source);
+	append_str(entry.response);
+	append(&entry.tokens, sizeof(entry.tokens));
+	const uint32_t count = (uint32_t)entry.deps.size();
+	append(&count, sizeof(count));
+	for (auto &dep : entry.deps)
+	{
+		append_str(dep.first);
+		append(&dep.second, sizeof(dep.second));
+	}
+
+	journal_record_header header;
+	header.size = (uint32_t)(record.size() - sizeof(header));
+	header.checksum = (uint32_t)cbl::compute_fingerprint(record.data() + sizeof(header), header.size).lo;
+	memcpy(record.data(), &header, sizeof(header));
+}
+
+static bool deserialize_journal_record(const uint8_t *&cursor, const uint8_t *end, timestamp_cache_key &key, timestamp_cache::changed_entry &entry)
+{
+	journal_record_header header;
+	if ((size_t)(end - cursor) < sizeof(header))
+		return false;
+	memcpy(&header, cursor, sizeof(header));
+	const uint8_t *p = cursor + sizeof(header);
+	if ((size_t)(end - p) < header.size || header.checksum != (uint32_t)cbl::compute_fingerprint(p, header.size).lo)
+		return false;
+	const uint8_t *record_end = p + header.size;
+
+	auto read = [&p, record_end](void *data, size_t size) -> bool
+	{
+		if ((size_t)(record_end - p) < size)
+			return false;
+		memcpy(data, p, size);
+		p += size;
+		return true;
+	};
+	auto read_str = [&p, record_end, &read](std::string &str) -> bool
+	{
+		uint32_t length;
+		if (!read(&length, sizeof(length)) || (size_t)(record_end - p) < length)
+			return false;
+		str.assign((const char *)p, length);
+		p += length;
+		return true;
+	};
+
+	uint32_t count;
+	if (!read(&key, sizeof(key)) || !read_str(entry.source) || !read_str(entry.response)
+		|| !read(&entry.tokens, sizeof(entry.tokens)) || !read(&count, sizeof(count)))
+		return false;
+	entry.deps.clear();
+	for (uint32_t i = 0; i < count; ++i)
+	{
+		std::pair<std::string, uint64_t> dep;
+		if (!read_str(dep.first) || !read(&dep.second, sizeof(dep.second)))
+			return false;
+		entry.deps.push_back(std::move(dep));
+	}
+	cursor = record_end;
+	return true;
+}
+
+// Starts a journal from scratch. Must be called with the journal mutex held, or before the cache is shared.
+static void reset_journal(timestamp_cache &cache, const char *path, const uint8_t *records = nullptr, size_t size = 0)
+{
+	if (cache.journal)
+		fclose(cache.journal);
+	cache.journal = fopen(path, "wb");
+	cache.journal_size = 0;
+	if (!cache.journal)
+	{
+		cbl::log_verbose("Failed to open timestamp cache journal for writing to %s", path);
+		return;
+	}
+	cbl::fs::disinherit_stream(cache.journal);
+	const uint64_t version = ((uint64_t)cache_version << 32) | (uint64_t)cbl::get_host_platform();
+	fwrite(&journal_magic, sizeof(journal_magic), 1, cache.journal);
+	fwrite(&version, sizeof(version), 1, cache.journal);
+	if (size > 0)
+		fwrite(records, 1, size, cache.journal);
+	fflush(cache.journal);
+	cache.journal_size = sizeof(journal_magic) + sizeof(version) + size;
+}
+
+// Must be called before the cache is shared.
+static void replay_journal(timestamp_cache &cache, const char *path)
+{
+	MTR_SCOPE_FUNC();
+	std::vector<uint8_t> contents;
+	if (FILE *f = fopen(path, "rb"))
+	{
+		fseek(f, 0, SEEK_END);
+		contents.resize(ftell(f));
+		fseek(f, 0, SEEK_SET);
+		contents.resize(fread(contents.data(), 1, contents.size(), f));
+		fclose(f);
+	}
+
+	const uint64_t expected_version = ((uint64_t)cache_version << 32) | (uint64_t)cbl::get_host_platform();
+	const size_t header_size = sizeof(journal_magic) + sizeof(expected_version);
+	magic m = {};
+	uint64_t v = 0;
+	if (contents.size() >= header_size)
+	{
+		memcpy(&m, contents.data(), sizeof(m));
+		memcpy(&v, contents.data() + sizeof(m), sizeof(v));
+	}
+	if (m.i != journal_magic.i || v != expected_version)
+	{
+		if (!contents.empty())
+			cbl::log_debug("[CacheSer] Discarding incompatible timestamp cache journal %s", path);
+		reset_journal(cache, path);
+		return;
+	}
+
+	const uint8_t *records = contents.data() + header_size;
+	const uint8_t *cursor = records;
+	const uint8_t *end = contents.data() + contents.size();
+	uint32_t replayed = 0;
+	timestamp_cache_key key;
+	timestamp_cache::changed_entry entry;
+	while (deserialize_journal_record(cursor, end, key, entry))
+	{
+		int64_t index = cache.view.find(key);
+		if (index >= 0)
+			cache.discarded[index] = 1;
+		cache.get_shard(key).changed[key] = std::move(entry);
+		++replayed;
+	}
+	cbl::log_verbose("Replayed %u timestamp cache journal records from %s", replayed, path);
+
+	if (cursor != end)
+	{
+		// Drop the torn tail, so that new records don't end up behind it.
+		cbl::log_verbose("Timestamp cache journal %s has a torn tail of %u bytes, truncating", path, (uint32_t)(end - cursor));
+		reset_journal(cache, path, records, cursor - records);
+	}
+	else
+	{
+		cache.journal = fopen(path, "ab");
+		cache.journal_size = contents.size();
+		if (cache.journal)
+			cbl::fs::disinherit_stream(cache.journal);
+	}
+}
+
 static std::unordered_map<cache_map_key, timestamp_cache> cache_map;
 static std::mutex cache_mutex;
 
@@ -511,20 +1694,33 @@ static timestamp_cache& find_or_create_cache(const target &target, const configu
 	{
 		timestamp_cache& cache = cache_map[key];
 		std::string cache_path = get_cache_path(target, cfg);
-		if (FILE *serialized = fopen(cache_path.c_str(), "rb"))
-		{
-			serialize_cache_items<fread, nullptr>(cache, serialized);
-			fclose(serialized);
-		}
-		else
+		if (!map_cache_file(cache, cache_path.c_str()))
 		{
-			log_verbose("Failed to open timestamp cache for reading from %s, using a blank slate", cache_path.c_str());
+			log_verbose("Failed to map timestamp cache from %s, using a blank slate", cache_path.c_str());
 		}
+		fs::mkdir(path::get_directory(cache_path.c_str()).c_str(), true);
+		replay_journal(cache, get_journal_path(target, cfg).c_str());
 		return cache;
 	}
 	return it->second;
 }
 
+static timestamp_cache& get_dependency_cache(build_context &ctx)
+{
+	return ctx.dependency_cache ? *ctx.dependency_cache : find_or_create_cache(ctx.trg, ctx.cfg);
+}
+
+// Include actions are interned, so that each header is represented by a single node with a single time stamp, shared
+// by all the translation units in the build graph.
+static std::unordered_map<std::string, std::shared_ptr<graph::action>> include_map;
+static std::mutex include_mutex;
+
+static void reset_include_actions()
+{
+	std::lock_guard<std::mutex> _(include_mutex);
+	include_map.clear();
+}
+
 static void for_each_cache(std::function<void(const cache_map_key &, timestamp_cache &)> callback)
 {
 	std::lock_guard<std::mutex> _(cache_mutex);
@@ -580,11 +1776,81 @@ static void dump_action(std::ostringstream& dump, std::shared_ptr<graph::action>
 	dump << tabs << "}\n";
 }
 
+static bool is_flattened(const flat_graph &flat, const action &a)
+{
+	return a.node_id < flat.actions.size() && flat.actions[a.node_id].get() == &a;
+}
+
+// Culling only ever drops inputs, so what remains of the graph is a subgraph of the flattened one, and keeps its
+// post-order. Surviving nodes are shifted down in place.
+static void compact_flat_graph(flat_graph &flat, const action_ptr &root)
+{
+	MTR_SCOPE_FUNC();
+	std::vector<bool> live(flat.size(), false);
+	if (root)
+		live[root->node_id] = true;
+	for (flat_graph::node_id n = (flat_graph::node_id)flat.size(); n-- > 0;)
+	{
+		if (!live[n])
+			continue;
+		for (const auto &input : flat.actions[n]->inputs)
+		{
+			if (!input)
+				continue;
+			if (!is_flattened(flat, *input) || input->node_id >= n)
+			{
+				// A cull handler has added something new after all.
+				flat = graph::flatten_build_graph(root);
+				return;
+			}
+			live[input->node_id] = true;
+		}
+	}
+
+	// Nodes only move down, and none gains inputs or outputs, so nothing gets overwritten before it has been read.
+	flat_graph::node_id count = 0;
+	uint32_t input_count = 0, output_count = 0;
+	for (flat_graph::node_id n = 0; n < flat.size(); ++n)
+	{
+		if (!live[n])
+			continue;
+		action_ptr current = std::move(flat.actions[n]);
+		flat.types[count] = current->type;
+		// Inputs have lower ids, so they have been given their new ones already.
+		for (const auto &input : current->inputs)
+		{
+			if (input)
+				flat.input_ids[input_count++] = input->node_id;
+		}
+		flat.input_offsets[count + 1] = input_count;
+		const bool has_timestamps = current->output_timestamps.size() == current->outputs.size();
+		for (size_t i = 0; i < current->outputs.size(); ++i)
+		{
+			flat.output_paths[output_count] = current->outputs[i].c_str();
+			flat.output_timestamps[output_count++] = has_timestamps ? current->output_timestamps[i] : 0;
+		}
+		flat.output_offsets[count + 1] = output_count;
+		current->node_id = count;
+		flat.actions[count++] = std::move(current);
+	}
+	flat.types.resize(count);
+	flat.actions.resize(count);
+	flat.input_offsets.resize(count + 1);
+	flat.input_ids.resize(input_count);
+	flat.output_offsets.resize(count + 1);
+	flat.output_paths.resize(output_count);
+	flat.output_timestamps.resize(output_count);
+}
+
 namespace graph
 {
 	std::shared_ptr<graph::action> generate_cpp_build_graph(build_context &ctx)
 	{
 		MTR_SCOPE_FUNC();
+		// Headers may have changed since the last graph was generated.
+		reset_include_actions();
+		reset_content_verification();
+		ctx.dependency_cache = &find_or_create_cache(ctx.trg, ctx.cfg);
 		// Presize the array for safe parallel writes to it.
 		decltype(action::inputs) objects;
 		auto sources = ctx.trg.second.enumerate_sources();
@@ -602,6 +1868,50 @@ namespace graph
 		return root;
 	}
 
+	int pipeline_cpp_build_graph(build_context &ctx, std::shared_ptr<graph::action>& root)
+	{
+		MTR_SCOPE_FUNC();
+		reset_include_actions();
+		reset_content_verification();
+		ctx.dependency_cache = &find_or_create_cache(ctx.trg, ctx.cfg);
+		// Presize the arrays for safe parallel writes to them.
+		decltype(action::inputs) objects;
+		auto sources = ctx.trg.second.enumerate_sources();
+		objects.resize(sources.size());
+
+		// Generation jobs share the workers with the compile actions they release.
+		action_executor executor(ctx);
+		executor.add_jobs((uint32_t)sources.size(), [&](uint32_t i)
+			{
+				std::string safe_source = cbl::jsonify(sources[i].c_str());
+				MTR_SCOPE_S(__FILE__, "Generating compile action", "source", safe_source.c_str());
+				objects[i] = ctx.tc.generate_compile_action_for_cpptu(ctx, sources[i].c_str());
+
+				// Objects are judged against their own inputs, so we can cull and kick off compilation right away.
+				auto compile = objects[i];
+				cull_action(ctx, compile, compile->get_oldest_output_timestamp());
+				if (compile && nullptr != g_action_handlers[compile->type].exec)
+					executor.add_action(compile);
+			});
+		int exit_code = executor.run();
+		if (exit_code != 0)
+			return exit_code;
+		const bool compiled_any = executor.get_executed_action_count() > 0;
+
+		root = ctx.tc.generate_link_action_for_objects(ctx, objects);
+
+		// All the objects are built by now, so the link only needs to consume them.
+		for (auto& o : objects)
+		{
+			o->inputs.clear();
+			o->update_output_timestamps();
+		}
+		// Freshly compiled objects need linking regardless; otherwise, see if the product is outdated.
+		if (!compiled_any)
+			cull_action(ctx, root, root->get_oldest_output_timestamp());
+		return execute_build_graph(ctx, root);
+	}
+
 	std::shared_ptr<graph::action> clone_build_graph(std::shared_ptr<graph::action> source)
 	{
 		MTR_SCOPE_FUNC();
@@ -622,26 +1932,68 @@ namespace graph
 	}
 	
 	void cull_build_graph(build_context &ctx,
-		std::shared_ptr<graph::action>& root)
+		std::shared_ptr<graph::action>& root,
+		flat_graph &flat)
 	{
 		MTR_SCOPE_FUNC();
+		assert(!flat.actions.empty() && flat.actions.back() == root && "Flat graph must have been flattened from root");
+		// Query all the time stamps up front in one flat pass, instead of piecemeal while walking the graph.
+		update_output_timestamps(flat);
 		cull_action(ctx, root, root->get_oldest_output_timestamp());
-		if (ctx.trg.second.cull_graph_hook && ctx.trg.second.cull_graph_hook(root))
-			cull_build_graph(ctx, root);
+		if (ctx.trg.second.cull_graph_hook)
+		{
+			// The hook may reshape the graph at will, so start over.
+			const bool recull = ctx.trg.second.cull_graph_hook(root);
+			flat = flatten_build_graph(root);
+			if (recull && root)
+				cull_build_graph(ctx, root, flat);
+		}
+		else
+			compact_flat_graph(flat, root);
+	}
+
+	void print_usage_summary(size_t count)
+	{
+		std::lock_guard<std::mutex> _(usage_mutex);
+		if (usage_records.empty())
+			return;
+		count = std::min(count, usage_records.size());
+
+		auto cpu_usec = [](const usage_record &r) { return r.usage.user_usec + r.usage.system_usec; };
+		uint64_t total_usec = 0;
+		for (auto &r : usage_records)
+			total_usec += cpu_usec(r);
+		cbl::info("%3.4fs of CPU time spent in %zu processes", (double)total_usec * 1e-6, usage_records.size());
+
+		std::partial_sort(usage_records.begin(), usage_records.begin() + count, usage_records.end(),
+			[&cpu_usec](const usage_record &a, const usage_record &b) { return cpu_usec(a) > cpu_usec(b); });
+		cbl::info("Top %zu by CPU time:", count);
+		for (size_t i = 0; i < count; ++i)
+			cbl::info("  %s: %s", usage_records[i].output.c_str(), describe_usage(usage_records[i].usage).c_str());
+
+		std::partial_sort(usage_records.begin(), usage_records.begin() + count, usage_records.end(),
+			[](const usage_record &a, const usage_record &b) { return a.usage.peak_rss_kb > b.usage.peak_rss_kb; });
+		cbl::info("Top %zu by peak memory:", count);
+		for (size_t i = 0; i < count; ++i)
+			cbl::info("  %s: %s", usage_records[i].output.c_str(), describe_usage(usage_records[i].usage).c_str());
 	}
 
 	int execute_build_graph(build_context &ctx,
 		std::shared_ptr<graph::action> root)
 	{
 		MTR_SCOPE_FUNC();
-		int exit_code = 0;
-		if (auto root_task = enqueue_build_tasks(ctx, root))
-		{
-			cbl::scheduler.AddTaskSetToPipe(root_task.get());
-			cbl::scheduler.WaitforTask(root_task.get());
-			exit_code = std::static_pointer_cast<action_exec_task>(root_task)->exit_code;
-		}
-		return exit_code;
+		if (!root)	// Empty graph, nothing to build.
+			return 0;
+		return execute_build_graph(ctx, flatten_build_graph(root));
+	}
+
+	int execute_build_graph(build_context &ctx,
+		const flat_graph &flat)
+	{
+		MTR_SCOPE_FUNC();
+		action_executor executor(ctx);
+		executor.add_graph(flat);
+		return executor.run();
 	}
 
 	void clean_build_graph_outputs(build_context &ctx, 
@@ -680,10 +2032,13 @@ namespace graph
 		{
 			if (t - g_action_handlers.size() > 1)
 				cbl::log_debug("Growing the handler vector by more than 1, this will insert nullptr handlers for type range [%d, %d]", g_action_handlers.size(), t - 1);
-			g_action_handlers.resize(t + 1, { nullptr, nullptr });
+			g_action_handlers.resize(t + 1, { nullptr, nullptr, nullptr, nullptr });
 		}
 		g_action_handlers[t].cull = cull_test;
 		g_action_handlers[t].exec = exec;
+		// Custom handlers take over execution entirely.
+		g_action_handlers[t].schedule = nullptr;
+		g_action_handlers[t].complete = nullptr;
 	}
 
 	bool operator==(const action_vector& a, const action_vector& b)
@@ -713,7 +2068,7 @@ namespace graph
 		output_timestamps.reserve(outputs.size());
 		for (auto& o : outputs)
 		{
-			output_timestamps.push_back(cbl::fs::get_modification_timestamp(o.c_str()));
+			output_timestamps.push_back(get_output_timestamp(type, o.c_str()));
 		}
 	}
 
@@ -783,6 +2138,7 @@ namespace graph
 	{
 		auto result = std::make_shared<cpp_action>();
 		result->response_file = response_file;
+		result->dependencies_unknown = dependencies_unknown;
 		return result;
 	}
 
@@ -797,84 +2153,737 @@ namespace graph
 
 		using namespace cbl;
 
+		// Saving does not overlap with builds, so the shards need no locking.
 		for_each_cache([](const cache_map_key &key, timestamp_cache &cache)
 		{
+			size_t changed_count = 0;
+			for (auto &shard : cache.shards)
+				changed_count += shard.changed.size();
+			// Journaled entries are safe already, so only compact once the journal has outgrown the cache file.
+			const uint64_t base_size = cache.mapping ? cache.mapping->size() : 0;
+			if (!cache.dirty && (changed_count == 0 || cache.journal_size <= base_size))
+				return;
+
+			// Carry over the surviving mapped entries, and add the ones inserted during this session.
+			cache_file_writer writer;
+			const auto &view = cache.view;
+			for (uint32_t i = 0; view.header && i < view.header->entry_count; ++i)
+			{
+				const auto &e = view.entries[i];
+				if (cache.discarded[i] || !view.is_valid_range(e))
+					continue;
+				writer.add(e.key, view.string_at(e.source), view.string_at(e.response), e.tokens, e.dependency_count, [&](uint32_t d)
+				{
+					const auto &dep = view.dependencies[e.first_dependency + d];
+					return std::make_pair(view.string_at(dep.path), dep.stamp);
+				});
+			}
+			for (auto &shard : cache.shards)
+			{
+				for (auto &entry : shard.changed)
+				{
+					const auto &deps = entry.second.deps;
+					writer.add(entry.first, entry.second.source.c_str(), entry.second.response.c_str(), entry.second.tokens, (uint32_t)deps.size(), [&](uint32_t d)
+					{
+						return std::make_pair(deps[d].first.c_str(), deps[d].second);
+					});
+				}
+			}
+			auto image = writer.finish();
+
+			// Write a new file and move it into place, so that the old one remains intact for as long as it's mapped.
 			std::string cache_path = get_cache_path(key.first, key.second);
+			std::string temp_path = cache_path + ".tmp";
 			fs::mkdir(path::get_directory(cache_path.c_str()).c_str(), true);
 			MTR_BEGIN(__FILE__, "fopen");
-			FILE *serialized = fopen(cache_path.c_str(), "wb");
+			FILE *serialized = fopen(temp_path.c_str(), "wb");
 			MTR_END(__FILE__, "fopen");
-			if (serialized)
+			if (!serialized)
+			{
+				log_verbose("Failed to open timestamp cache for writing to %s", temp_path.c_str());
+				return;
+			}
+			const bool written = image.size() == fwrite(image.data(), 1, image.size(), serialized);
 			{
-				serialize_cache_items<fwrite_wrapper, nullptr>(cache, serialized);
 				MTR_SCOPE(__FILE__, "fclose");
-				fclose(serialized);
+				if (0 != fclose(serialized) || !written)
+				{
+					log_verbose("Failed to write timestamp cache to %s", temp_path.c_str());
+					fs::delete_file(temp_path.c_str());
+					return;
+				}
 			}
-			else
+			// Windows won't replace a file that is mapped.
+			auto old_mapping = std::move(cache.mapping);
+			cache.view = cache_file_view();
+			old_mapping.reset();
+			if (!fs::move_file(temp_path.c_str(), cache_path.c_str(), fs::overwrite))
 			{
-				log_verbose("Failed to open timestamp cache for writing to %s", cache_path.c_str());
+				log_verbose("Failed to move timestamp cache into place at %s", cache_path.c_str());
+				fs::delete_file(temp_path.c_str());
+				// Keep going with what we have; the journal still holds the changes.
+				auto discarded = std::move(cache.discarded);
+				map_cache_file(cache, cache_path.c_str());
+				if (discarded.size() == cache.discarded.size())
+					cache.discarded = std::move(discarded);
+				return;
 			}
+			// The new file contains everything, so start afresh from it.
+			for (auto &shard : cache.shards)
+				shard.changed.clear();
+			cache.dirty = false;
+			map_cache_file(cache, cache_path.c_str());
+			std::lock_guard<std::mutex> _(cache.journal_mutex);
+			reset_journal(cache, get_journal_path(key.first, key.second).c_str());
 		});
+
+		save_duration_histories();
+		save_content_hashes();
+	}
+
+	flat_graph flatten_build_graph(action_ptr root)
+	{
+		MTR_SCOPE_FUNC();
+		flat_graph flat;
+		flat.input_offsets.push_back(0);
+		flat.output_offsets.push_back(0);
+		if (!root)
+			return flat;
+
+		// Iterative post-order walk. The second member is the index of the next input to visit.
+		std::vector<std::pair<action_ptr, size_t>> stack;
+		stack.emplace_back(root, 0);
+		while (!stack.empty())
+		{
+			const auto current = stack.back().first;
+			size_t &next_input = stack.back().second;
+			if (next_input < current->inputs.size())
+			{
+				const auto &input = current->inputs[next_input++];
+				if (input && !is_flattened(flat, *input))
+					stack.emplace_back(input, 0);
+				continue;
+			}
+
+			// All inputs have been assigned ids by now.
+			assert(flat.types.size() < std::numeric_limits<flat_graph::node_id>::max() && "Node id overflow");
+			current->node_id = (flat_graph::node_id)flat.types.size();
+			flat.types.push_back(current->type);
+			for (const auto &input : current->inputs)
+			{
+				if (input)
+					flat.input_ids.push_back(input->node_id);
+			}
+			flat.input_offsets.push_back((uint32_t)flat.input_ids.size());
+			const bool has_timestamps = current->output_timestamps.size() == current->outputs.size();
+			for (size_t i = 0; i < current->outputs.size(); ++i)
+			{
+				flat.output_paths.push_back(current->outputs[i].c_str());
+				flat.output_timestamps.push_back(has_timestamps ? current->output_timestamps[i] : 0);
+			}
+			flat.output_offsets.push_back((uint32_t)flat.output_paths.size());
+			flat.actions.push_back(current);
+			stack.pop_back();
+		}
+		return flat;
+	}
+
+	void update_output_timestamps(flat_graph &flat)
+	{
+		MTR_SCOPE_FUNC();
+		// Every node is visited exactly once, so writing back to the actions is race-free.
+		cbl::parallel_for([&](uint32_t n)
+			{
+				auto &a = *flat.actions[n];
+				// Already known, and copied over when flattening.
+				if (a.output_timestamps.size() == a.outputs.size())
+					return;
+				const auto begin = flat.output_offsets[n], end = flat.output_offsets[n + 1];
+				for (uint32_t i = begin; i < end; ++i)
+					flat.output_timestamps[i] = get_output_timestamp(flat.types[n], flat.output_paths[i]);
+				a.output_timestamps.assign(flat.output_timestamps.begin() + begin, flat.output_timestamps.begin() + end);
+			},
+			(uint32_t)flat.size(), 100);
+	}
+
+	std::shared_ptr<action> find_or_create_include_action(const std::string &path)
+	{
+		{
+			std::lock_guard<std::mutex> _(include_mutex);
+			auto it = include_map.find(path);
+			if (it != include_map.end())
+				return it->second;
+		}
+
+		// Stat outside of the lock; the time stamp is filled in up front, so that shared nodes are never mutated later.
+		auto include = std::make_shared<cpp_action>();
+		include->type = (action::action_type)cpp_action::include;
+		include->outputs.push_back(path);
+		include->update_output_timestamps();
+
+		std::lock_guard<std::mutex> _(include_mutex);
+		// Another thread may have beaten us to it, in which case we use theirs.
+		return include_map.emplace(path, include).first->second;
 	}
 
 	bool query_dependency_cache(build_context &ctx,
 		const std::string& source,
 		const char *response,
-		std::function<void(const std::string &)> push_dep)
+		std::function<void(const std::string &)> push_dep,
+		cbl::fingerprint *token_hash,
+		uint64_t *newest_dependency)
 	{
 		MTR_SCOPE_FUNC();
 
-		auto& cache = find_or_create_cache(ctx.trg, ctx.cfg);
-		
-		const auto key = timestamp_cache_key{ source, response };
-		auto it = cache.find(key);
-		if (it != cache.end())
+		auto& cache = get_dependency_cache(ctx);
+
+		// Entries inserted during this session take precedence over the mapped ones. The latter are looked up in place;
+		// holding a reference to the mapping keeps them valid even if the cache is saved in the meantime.
+		const auto key = make_cache_key(source, response);
+		dependency_timestamp_vector changed;
+		bool found_changed = false;
+		cbl::fingerprint tokens{ 0, 0 };
+		std::shared_ptr<cbl::fs::file_mapping> mapping;
+		cache_file_view view;
+		int64_t index = -1;
+		auto &shard = cache.get_shard(key);
 		{
-			bool up_to_date = true;
-			cbl::parallel_for(
-				[&](uint32_t i)
+			std::lock_guard<std::mutex> _(shard.mutex);
+			auto it = shard.changed.find(key);
+			if (it != shard.changed.end())
 			{
-				const auto &entry = *(it->second.begin() + i);
-				uint64_t stamp = cbl::fs::get_modification_timestamp(entry.first.c_str());
-				if (stamp == 0 || stamp != entry.second)
+				found_changed = verify_cache_key(it->second.source.c_str(), it->second.response.c_str(), source, response);
+				if (found_changed)
 				{
-					cbl::log_verbose("Outdated time stamp for dependency %s (%" PRId64 " vs %" PRId64 ") of %s", entry.first.c_str(), stamp, entry.second, source.c_str());
-					up_to_date = false;
+					changed = it->second.deps;
+					tokens = it->second.tokens;
 				}
-			},
-				it->second.size(),
-				100
-			);
-			if (up_to_date)
+			}
+			else
 			{
-				for (const auto &entry : it->second)
+				index = cache.view.find(key);
+				if (index >= 0 && !cache.discarded[index] && cache.view.is_valid_range(cache.view.entries[index])
+					&& verify_cache_key(cache.view.string_at(cache.view.entries[index].source), cache.view.string_at(cache.view.entries[index].response), source, response))
 				{
-					push_dep(entry.first);
+					mapping = cache.mapping;
+					view = cache.view;
+					tokens = view.entries[index].tokens;
 				}
-				cbl::log_verbose("Timestamp cache HIT for TU %s", source.c_str());
-				return true;
+				else
+					index = -1;
 			}
-			else
+		}
+		if (token_hash)
+			*token_hash = tokens;
+		if (newest_dependency)
+			*newest_dependency = 0;
+		if (index < 0 && !found_changed)
+		{
+			cbl::log_verbose("Timestamp cache MISS for TU %s", source.c_str());
+			return false;
+		}
+
+		const cache_file_dependency *mapped_deps = index >= 0 ? view.dependencies + view.entries[index].first_dependency : nullptr;
+		const uint32_t count = index >= 0 ? view.entries[index].dependency_count : (uint32_t)changed.size();
+		auto get_path = [&](uint32_t i) { return mapped_deps ? view.string_at(mapped_deps[i].path) : changed[i].first.c_str(); };
+		auto get_stamp = [&](uint32_t i) { return mapped_deps ? mapped_deps[i].stamp : changed[i].second; };
+
+		if (newest_dependency)
+		{
+			for (uint32_t i = 0; i < count; ++i)
+				*newest_dependency = std::max(*newest_dependency, get_stamp(i));
+		}
+
+		bool up_to_date = true;
+		cbl::parallel_for(
+			[&](uint32_t i)
+		{
+			const char *path = get_path(i);
+			uint64_t stamp = find_or_create_include_action(path)->get_oldest_output_timestamp();
+			if (stamp == 0 || stamp != get_stamp(i))
 			{
-				cache.erase(it);
-				cbl::log_verbose("Timestamp cache STALE for TU %s, discarded", source.c_str());
-				return false;
+				cbl::log_verbose("Outdated time stamp for dependency %s (%" PRId64 " vs %" PRId64 ") of %s", path, stamp, get_stamp(i), source.c_str());
+				up_to_date = false;
+			}
+		},
+			count,
+			100
+		);
+		if (up_to_date)
+		{
+			for (uint32_t i = 0; i < count; ++i)
+			{
+				push_dep(get_path(i));
 			}
+			cbl::log_verbose("Timestamp cache HIT for TU %s", source.c_str());
+			return true;
+		}
+		else
+		{
+			std::lock_guard<std::mutex> _(shard.mutex);
+			if (index >= 0 && mapping == cache.mapping)
+				cache.discarded[index] = 1;
+			else if (index < 0)
+				shard.changed.erase(key);
+			cache.dirty = true;
+			cbl::log_verbose("Timestamp cache STALE for TU %s, discarded", source.c_str());
+			return false;
 		}
-		cbl::log_verbose("Timestamp cache MISS for TU %s", source.c_str());
-		return false;
 	}
 
 	void insert_dependency_cache(build_context &ctx,
 		const std::string& source,
 		const char *response,
-		const dependency_timestamp_vector &deps)
+		const dependency_timestamp_vector &deps,
+		const cbl::fingerprint *token_hash)
+	{
+		MTR_SCOPE_FUNC();
+
+		auto& cache = get_dependency_cache(ctx);
+
+		const auto key = make_cache_key(source, response);
+		timestamp_cache::changed_entry entry{ source, g_options.debug_cache_keys.val.as_bool ? response : "", deps, token_hash ? *token_hash : cbl::fingerprint{ 0, 0 } };
+		std::vector<uint8_t> record;
+		serialize_journal_record(record, key, entry);
+
+		// Dependencies may be captured from concurrently running compile actions.
+		{
+			std::lock_guard<std::mutex> _(cache.journal_mutex);
+			if (cache.journal && record.size() == fwrite(record.data(), 1, record.size(), cache.journal) && 0 == fflush(cache.journal))
+				cache.journal_size += record.size();
+			else
+				cache.dirty = true;
+		}
+		auto &shard = cache.get_shard(key);
+		std::lock_guard<std::mutex> _(shard.mutex);
+		shard.changed[key] = std::move(entry);
+		// Supersede the mapped entry, if any.
+		int64_t index = cache.view.find(key);
+		if (index >= 0)
+			cache.discarded[index] = 1;
+	}
+
+	// Response files share the content hash store, with the fingerprint of the response in place of the hash.
+	bool query_response_file_cache(const char *response_file, const cbl::fingerprint &contents)
+	{
+		// Memoized, as the culling pass needs the time stamp anyway.
+		const uint64_t stamp = cbl::fs::get_modification_timestamp(response_file);
+		if (stamp == 0)
+			return false;
+		std::lock_guard<std::mutex> _(content_mutex);
+		load_content_hashes();
+		auto it = content_map.find(response_file);
+		return it != content_map.end() && it->second.identity.timestamp == stamp && it->second.hash == contents;
+	}
+
+	void insert_response_file_cache(const char *response_file, const cbl::fingerprint &contents)
+	{
+		content_record record{};
+		record.identity.timestamp = record.stamp = cbl::fs::get_modification_timestamp(response_file);
+		record.hash = contents;
+		std::lock_guard<std::mutex> _(content_mutex);
+		content_map[response_file] = record;
+		content_dirty = true;
+	}
+
+	static constexpr magic manifest_magic = { 'C', 'B', 'M', 'F' };
+	// Increment this counter every time the manifest binary format changes.
+	static constexpr uint32_t manifest_version = 1;
+
+	static std::string get_manifest_path(const target &target, const configuration& cfg)
+	{
+		using namespace cbl;
+		using namespace cbl::path;
+		return join(get_cppbuild_cache_path(), join(get_platform_str(cfg.second.platform), join(target.first, cfg.first + ".manifest")));
+	}
+
+	// Anything that goes into the response files, apart from the individual paths.
+	static cbl::fingerprint compute_manifest_key(build_context &ctx, const string_vector &sources)
+	{
+		MTR_SCOPE_FUNC();
+		std::string key;
+		auto append = [&key](const std::string &s) { key += s; key += '\0'; };
+		// The descriptions are compiled into the executable, so it changing covers build.cpp changing.
+		append(std::to_string(cbl::fs::get_modification_timestamp(cbl::process::get_current_executable_path().c_str())));
+		append(ctx.trg.first);
+		append(std::to_string((int)ctx.trg.second.type));
+		append(ctx.trg.second.output);
+		append(ctx.trg.second.used_toolchain ? ctx.trg.second.used_toolchain : "");
+		append(ctx.cfg.first);
+		const auto &cfg = ctx.cfg.second;
+		append(std::to_string((int)cfg.platform) + ' ' + std::to_string((int)cfg.standard) + ' ' + std::to_string((int)cfg.optimize) + ' '
+			+ std::to_string(cfg.emit_debug_information) + std::to_string(cfg.use_debug_crt) + std::to_string(cfg.use_exceptions));
+		// Transient definitions deliberately left out, as they do not affect whether anything is up to date.
+		for (auto &d : cfg.definitions)
+			append(d.first + '=' + d.second);
+		for (auto &i : cfg.additional_include_directories)
+			append(i);
+		std::vector<std::pair<std::string, std::string>> options(cfg.additional_toolchain_options.begin(), cfg.additional_toolchain_options.end());
+		std::sort(options.begin(), options.end());
+		for (auto &o : options)
+			append(o.first + '=' + o.second);
+		// Options that change which outputs are judged up to date.
+		append(std::to_string(g_options.content_hashes.val.as_bool) + std::to_string(g_options.token_hashes.val.as_bool)
+			+ std::to_string(g_options.restat.val.as_bool));
+		append(std::to_string(sources.size()));
+		for (auto &s : sources)
+			append(s);
+		return cbl::compute_fingerprint(key.data(), key.size());
+	}
+
+	bool query_build_manifest(build_context &ctx, const string_vector &sources)
+	{
+		MTR_SCOPE_FUNC();
+		std::string path = get_manifest_path(ctx.trg, ctx.cfg);
+		FILE *f = fopen(path.c_str(), "rb");
+		if (!f)
+			return false;
+
+		dependency_timestamp_vector files;
+		bool valid = false;
+		magic m;
+		uint64_t v, count;
+		cbl::fingerprint key;
+		const uint64_t expected_version = ((uint64_t)manifest_version << 32) | (uint64_t)cbl::get_host_platform();
+		if (1 == fread(&m, sizeof(m), 1, f) && m.i == manifest_magic.i
+			&& 1 == fread(&v, sizeof(v), 1, f) && v == expected_version
+			&& 1 == fread(&key, sizeof(key), 1, f) && key == compute_manifest_key(ctx, sources)
+			&& 1 == fread(&count, sizeof(count), 1, f))
+		{
+			files.resize(count);
+			uint64_t i = 0;
+			for (; i < count; ++i)
+			{
+				uint32_t length;
+				if (1 != fread(&length, sizeof(length), 1, f))
+					break;
+				files[i].first.resize(length);
+				if (length != fread(&files[i].first[0], 1, length, f) || 1 != fread(&files[i].second, sizeof(files[i].second), 1, f))
+					break;
+			}
+			valid = i == count;
+		}
+		else
+			cbl::log_debug("[Manifest] Header or key mismatch in %s, discarding", path.c_str());
+		fclose(f);
+		if (!valid)
+			return false;
+
+		// One batched pass over the file system. Stamps land in the metadata cache, should the graph be needed after all.
+		std::atomic_bool changed(false);
+		cbl::parallel_for([&](uint32_t i)
+			{
+				if (changed)
+					return;
+				if (files[i].second == 0 || files[i].second != cbl::fs::get_modification_timestamp(files[i].first.c_str()))
+				{
+					cbl::log_verbose("[Manifest] %s changed since the last successful build", files[i].first.c_str());
+					changed = true;
+				}
+			},
+			(uint32_t)files.size(), 1000);
+		return !changed;
+	}
+
+	bool collect_build_manifest(const flat_graph &flat, dependency_timestamp_vector &files)
+	{
+		MTR_SCOPE_FUNC();
+		if (flat.size() == 0)
+			return false;
+		files.reserve(flat.output_paths.size() + flat.size());
+		for (flat_graph::node_id n = 0; n < flat.size(); ++n)
+		{
+			const auto type = flat.types[n];
+			const bool is_output = type == (action::action_type)cpp_action::link || type == (action::action_type)cpp_action::compile;
+			if (is_output)
+			{
+				const auto &as_cpp_action = static_cast<const cpp_action &>(*flat.actions[n]);
+				if (as_cpp_action.dependencies_unknown)
+					return false;
+				files.emplace_back(as_cpp_action.response_file, cbl::fs::get_modification_timestamp(as_cpp_action.response_file.c_str()));
+			}
+			else if (type != (action::action_type)cpp_action::source && type != (action::action_type)cpp_action::include)
+			{
+				// Custom actions may depend on anything.
+				return false;
+			}
+			for (uint32_t o = flat.output_offsets[n]; o < flat.output_offsets[n + 1]; ++o)
+				files.emplace_back(flat.output_paths[o], is_output ? 0 : cbl::fs::get_modification_timestamp(flat.output_paths[o]));
+		}
+		return true;
+	}
+
+	void save_build_manifest(build_context &ctx, const string_vector &sources, dependency_timestamp_vector &files)
 	{
 		MTR_SCOPE_FUNC();
+		for (auto &file : files)
+		{
+			if (file.second == 0)
+				file.second = cbl::fs::get_modification_timestamp(file.first.c_str());
+		}
+
+		std::string path = get_manifest_path(ctx.trg, ctx.cfg);
+		cbl::fs::mkdir(cbl::path::get_directory(path.c_str()).c_str(), true);
+		FILE *f = fopen(path.c_str(), "wb");
+		if (!f)
+		{
+			cbl::log_verbose("Failed to open build manifest for writing to %s", path.c_str());
+			return;
+		}
+		const uint64_t version = ((uint64_t)manifest_version << 32) | (uint64_t)cbl::get_host_platform();
+		const cbl::fingerprint key = compute_manifest_key(ctx, sources);
+		const uint64_t count = files.size();
+		fwrite(&manifest_magic, sizeof(manifest_magic), 1, f);
+		fwrite(&version, sizeof(version), 1, f);
+		fwrite(&key, sizeof(key), 1, f);
+		fwrite(&count, sizeof(count), 1, f);
+		for (auto &file : files)
+		{
+			const uint32_t length = (uint32_t)file.first.length();
+			fwrite(&length, sizeof(length), 1, f);
+			fwrite(file.first.data(), 1, length, f);
+			fwrite(&file.second, sizeof(file.second), 1, f);
+		}
+		fclose(f);
+	}
+
+	static constexpr magic snapshot_magic = { 'C', 'B', 'S', 'S' };
+	// Increment this counter every time the snapshot binary format changes.
+	static constexpr uint32_t snapshot_version = 1;
 
-		auto& cache = find_or_create_cache(ctx.trg, ctx.cfg);
+	// Paths outside of the project (e.g. system headers) are kept as they are.
+	static std::string get_relocatable_path(const std::string &path)
+	{
+		std::string relative = cbl::path::get_relative_to(path.c_str());
+		return relative.compare(0, 2, "..") == 0 ? path : relative;
+	}
+
+	static bool read_snapshot_blob(FILE *f, std::string &blob)
+	{
+		uint64_t size;
+		if (1 != fread(&size, sizeof(size), 1, f))
+			return false;
+		blob.resize(size);
+		return size == 0 || size == fread(&blob[0], 1, size, f);
+	}
+
+	static void write_snapshot_blob(FILE *f, const void *data, uint64_t size)
+	{
+		fwrite(&size, sizeof(size), 1, f);
+		fwrite(data, 1, size, f);
+	}
+
+	// Newest time stamp that the object of the translation unit must not be older than, dependencies aside.
+	static uint64_t get_newest_own_input_timestamp(build_context &ctx, const std::string &source)
+	{
+		const uint64_t source_timestamp = get_output_timestamp((action::action_type)cpp_action::source, source.c_str());
+		const uint64_t response_timestamp = cbl::fs::get_modification_timestamp(generic_cpp_toolchain::get_response_file_for_cpptu(ctx, source.c_str()).c_str());
+		return std::max(source_timestamp, response_timestamp);
+	}
+
+	bool export_cache_snapshot(build_context &ctx, const char *path)
+	{
+		MTR_SCOPE_FUNC_S("path", path);
+		auto *tc = dynamic_cast<generic_cpp_toolchain *>(&ctx.tc);
+		if (!tc)
+		{
+			cbl::error("Toolchain of target %s does not support cache snapshots", ctx.trg.first.c_str());
+			return false;
+		}
+
+		struct unit
+		{
+			std::string object;
+			cbl::fingerprint response;
+			cbl::fingerprint tokens;
+			string_vector dependencies;
+			bool up_to_date = false;
+		};
+		auto sources = ctx.trg.second.enumerate_sources();
+		std::vector<unit> units(sources.size());
+		cbl::parallel_for([&](uint32_t i)
+			{
+				unit &u = units[i];
+				u.object = tc->get_object_for_cpptu(ctx, sources[i].c_str());
+				const std::string response = tc->generate_compiler_response(ctx, u.object.c_str(), sources[i].c_str());
+				u.response = cbl::compute_fingerprint(response.data(), response.size());
+				uint64_t newest = 0;
+				if (!query_dependency_cache(ctx, sources[i], response.c_str(), [&u](const std::string &d) { u.dependencies.push_back(d); }, &u.tokens, &newest))
+					return;
+				newest = std::max(newest, get_newest_own_input_timestamp(ctx, sources[i]));
+				const uint64_t object_timestamp = cbl::fs::get_modification_timestamp(u.object.c_str());
+				u.up_to_date = object_timestamp != 0 && get_build_timestamp(u.object.c_str(), object_timestamp) > newest;
+			},
+			(uint32_t)sources.size(), 1);
+
+		// Sources and headers are shared among the translation units, so they are stored (and hashed) once.
+		string_vector files;
+		std::unordered_map<std::string, uint32_t> file_indices;
+		auto index_of = [&](const std::string &file)
+		{
+			auto it = file_indices.emplace(file, (uint32_t)files.size());
+			if (it.second)
+				files.push_back(file);
+			return it.first->second;
+		};
+		std::vector<std::vector<uint32_t>> unit_files(units.size());
+		for (size_t i = 0; i < units.size(); ++i)
+		{
+			if (!units[i].up_to_date)
+				continue;
+			unit_files[i].push_back(index_of(sources[i]));
+			for (auto &d : units[i].dependencies)
+				unit_files[i].push_back(index_of(d));
+		}
+		std::vector<cbl::fingerprint> hashes(files.size());
+		cbl::parallel_for([&](uint32_t i) { hashes[i] = hash_file_contents(files[i].c_str()); }, (uint32_t)files.size(), 100);
+
+		std::string temp_path = std::string(path) + ".tmp";
+		FILE *f = fopen(temp_path.c_str(), "wb");
+		if (!f)
+		{
+			cbl::error("Failed to open cache snapshot for writing to %s", temp_path.c_str());
+			return false;
+		}
+		const uint64_t version = ((uint64_t)snapshot_version << 32) | (uint64_t)cbl::get_host_platform();
+		const uint64_t file_count = files.size();
+		fwrite(&snapshot_magic, sizeof(snapshot_magic), 1, f);
+		fwrite(&version, sizeof(version), 1, f);
+		fwrite(&file_count, sizeof(file_count), 1, f);
+		for (size_t i = 0; i < files.size(); ++i)
+		{
+			const std::string relocatable = get_relocatable_path(files[i]);
+			write_snapshot_blob(f, relocatable.data(), relocatable.size());
+			fwrite(&hashes[i], sizeof(hashes[i]), 1, f);
+		}
+		uint64_t exported = 0;
+		for (size_t i = 0; i < units.size(); ++i)
+		{
+			if (!units[i].up_to_date)
+				continue;
+			cbl::fs::file_mapping object(units[i].object.c_str());
+			if (!object.is_valid())
+				continue;
+			// The source comes first, followed by the dependencies.
+			const uint32_t count = (uint32_t)unit_files[i].size();
+			fwrite(&count, sizeof(count), 1, f);
+			fwrite(unit_files[i].data(), sizeof(uint32_t), count, f);
+			fwrite(&units[i].response, sizeof(units[i].response), 1, f);
+			fwrite(&units[i].tokens, sizeof(units[i].tokens), 1, f);
+			write_snapshot_blob(f, object.data(), object.size());
+			++exported;
+		}
+		const bool written = !ferror(f);
+		if (0 != fclose(f) || !written || !cbl::fs::move_file(temp_path.c_str(), path, cbl::fs::overwrite))
+		{
+			cbl::error("Failed to write cache snapshot to %s", path);
+			cbl::fs::delete_file(temp_path.c_str());
+			return false;
+		}
+		cbl::info("Exported %" PRIu64 " of %zu translation units to cache snapshot %s", exported, units.size(), path);
+		return true;
+	}
+
+	int import_cache_snapshot(build_context &ctx, const char *path)
+	{
+		MTR_SCOPE_FUNC_S("path", path);
+		auto *tc = dynamic_cast<generic_cpp_toolchain *>(&ctx.tc);
+		if (!tc)
+		{
+			cbl::warning("Toolchain of target %s does not support cache snapshots", ctx.trg.first.c_str());
+			return -1;
+		}
+		FILE *f = fopen(path, "rb");
+		if (!f)
+		{
+			cbl::warning("Failed to open cache snapshot %s", path);
+			return -1;
+		}
+		cbl::scoped_guard close_snapshot([f]() { fclose(f); });
+
+		magic m;
+		uint64_t v, file_count;
+		const uint64_t expected_version = ((uint64_t)snapshot_version << 32) | (uint64_t)cbl::get_host_platform();
+		if (1 != fread(&m, sizeof(m), 1, f) || m.i != snapshot_magic.i
+			|| 1 != fread(&v, sizeof(v), 1, f) || v != expected_version
+			|| 1 != fread(&file_count, sizeof(file_count), 1, f))
+		{
+			cbl::warning("Cache snapshot %s is malformed or of an incompatible version", path);
+			return -1;
+		}
+		string_vector files(file_count);
+		std::vector<cbl::fingerprint> hashes(file_count);
+		for (uint64_t i = 0; i < file_count; ++i)
+		{
+			if (!read_snapshot_blob(f, files[i]) || 1 != fread(&hashes[i], sizeof(hashes[i]), 1, f))
+			{
+				cbl::warning("Cache snapshot %s is truncated", path);
+				return -1;
+			}
+		}
+
+		// Only the files whose contents match ours let the translation units that depend on them in.
+		std::vector<uint8_t> matches(file_count);
+		cbl::parallel_for([&](uint32_t i)
+			{
+				matches[i] = 0 != cbl::fs::get_modification_timestamp(files[i].c_str()) && hash_file_contents(files[i].c_str()) == hashes[i];
+			},
+			(uint32_t)file_count, 100);
 
-		const auto key = timestamp_cache_key{ source, response };
-		cache[key] = deps;
+		int imported = 0, total = 0;
+		std::vector<uint32_t> unit_files;
+		cbl::fingerprint response_hash, tokens;
+		std::string object_contents;
+		for (;;)
+		{
+			uint32_t count;
+			if (1 != fread(&count, sizeof(count), 1, f))
+				break;
+			unit_files.resize(count);
+			if (count == 0 || count != fread(unit_files.data(), sizeof(uint32_t), count, f)
+				|| 1 != fread(&response_hash, sizeof(response_hash), 1, f)
+				|| 1 != fread(&tokens, sizeof(tokens), 1, f)
+				|| !read_snapshot_blob(f, object_contents))
+			{
+				cbl::warning("Cache snapshot %s is truncated", path);
+				break;
+			}
+			++total;
+			bool match = true;
+			for (uint32_t file : unit_files)
+				match = match && file < file_count && matches[file];
+			if (!match)
+				continue;
+
+			// The compiler command line must be the same, too.
+			const std::string &source = files[unit_files[0]];
+			const std::string object = tc->get_object_for_cpptu(ctx, source.c_str());
+			const std::string response = tc->generate_compiler_response(ctx, object.c_str(), source.c_str());
+			if (cbl::compute_fingerprint(response.data(), response.size()) != response_hash)
+			{
+				cbl::log_verbose("Command line of %s differs from the cache snapshot, not importing it", source.c_str());
+				continue;
+			}
+			tc->update_response_file(ctx, generic_cpp_toolchain::get_response_file_for_cpptu(ctx, source.c_str()).c_str(), response.c_str());
+			if (cbl::fs::cache_update_result::outdated_failure == cbl::fs::update_file_backed_cache(object.c_str(), object_contents.data(), object_contents.size()))
+				continue;
+
+			// Re-stamp with our own time stamps, and make sure the object is strictly the newest of them all, as inputs
+			// only get culled when older than their consumer.
+			dependency_timestamp_vector deps;
+			uint64_t newest = get_newest_own_input_timestamp(ctx, source);
+			for (uint32_t i = 1; i < count; ++i)
+			{
+				const uint64_t stamp = find_or_create_include_action(files[unit_files[i]])->get_oldest_output_timestamp();
+				deps.emplace_back(files[unit_files[i]], stamp);
+				newest = std::max(newest, stamp);
+			}
+			insert_dependency_cache(ctx, source, response.c_str(), deps, &tokens);
+			if (cbl::fs::get_modification_timestamp(object.c_str()) <= newest)
+				cbl::fs::set_modification_timestamp(object.c_str(), newest + 1);
+			++imported;
+		}
+		cbl::info("Imported %d of %d translation units from cache snapshot %s", imported, total, path);
+		return imported;
 	}
 };
@@ -27,6 +27,7 @@ SOFTWARE.
 #include "detail.h"
 
 #include <sstream>
+#include <thread>
 
 void dump_builds(const target_map& t, const configuration_map& c)
 {
@@ -99,7 +100,7 @@ void dump_graph(std::shared_ptr<graph::action> root)
 	cbl::info("Dumping build graph:\n%s", dump.str().c_str());
 }
 
-std::pair<build_context, std::shared_ptr<graph::action>> setup_build(target& target, const configuration& cfg, toolchain_map& toolchains)
+build_context setup_build_context(target& target, const configuration& cfg, toolchain_map& toolchains)
 {
 	const char *used_tc = target.second.used_toolchain;
 	if (!used_tc)
@@ -116,11 +117,19 @@ std::pair<build_context, std::shared_ptr<graph::action>> setup_build(target& tar
 	assert(toolchains.find(used_tc) != toolchains.end() && "Unknown toolchain");
 	auto& tc = toolchains[used_tc];
 
-	build_context ctx{ target, cfg, *tc };
+	// Each build starts a new metadata cache session.
+	cbl::fs::invalidate_all_metadata();
+
+	return build_context{ target, cfg, *tc };
+}
+
+std::pair<build_context, std::shared_ptr<graph::action>> setup_build(target& target, const configuration& cfg, toolchain_map& toolchains)
+{
+	build_context ctx = setup_build_context(target, cfg, toolchains);
 	return { ctx, graph::generate_cpp_build_graph(ctx) };
 }
 
-void cull_build(build_context& ctx, std::shared_ptr<graph::action>& root)
+void cull_build(build_context& ctx, std::shared_ptr<graph::action>& root, graph::flat_graph& flat)
 {
 	if (g_options.dump_graph.val.as_int32 > 1)
 	{
@@ -128,7 +137,7 @@ void cull_build(build_context& ctx, std::shared_ptr<graph::action>& root)
 		dump_graph(std::static_pointer_cast<graph::cpp_action>(root));
 	}
 
-	graph::cull_build_graph(ctx, root);
+	graph::cull_build_graph(ctx, root, flat);
 
 	if (g_options.dump_graph.val.as_int32 > 0)
 	{
@@ -139,16 +148,75 @@ void cull_build(build_context& ctx, std::shared_ptr<graph::action>& root)
 	graph::save_timestamp_caches();
 }
 
-int execute_build(build_context& ctx, std::shared_ptr<graph::action> root)
+int execute_build(build_context& ctx, std::shared_ptr<graph::action> root, const graph::flat_graph& flat)
 {
 	int exit_code = root
-		? graph::execute_build_graph(ctx, root)
+		? graph::execute_build_graph(ctx, flat)
 		: (cbl::info("Target %s up to date", ctx.trg.first.c_str()), 0);
-		
+	
+	// Compile actions may have captured new dependencies.
+	if (root)
+		graph::save_timestamp_caches();
+
+	auto stats = cbl::fs::get_metadata_cache_stats();
+	cbl::log_verbose("File metadata cache: %" PRIu64 " hits, %" PRIu64 " misses", stats.hits, stats.misses);
+
+	cbl::info("Build finished with code %d", exit_code);
+	return exit_code;
+}
+
+int pipeline_build(build_context& ctx)
+{
+	std::shared_ptr<graph::action> root;
+	int exit_code = graph::pipeline_cpp_build_graph(ctx, root);
+
+	if (g_options.dump_graph.val.as_int32 > 0)
+	{
+		cbl::info("After culling:");
+		dump_graph(std::static_pointer_cast<graph::cpp_action>(root));
+	}
+
+	graph::save_timestamp_caches();
+
+	if (!root && exit_code == 0)
+		cbl::info("Target %s up to date", ctx.trg.first.c_str());
 	cbl::info("Build finished with code %d", exit_code);
 	return exit_code;
 }
 
+int build_target(build_context& ctx)
+{
+	// Graph hooks expect to see the whole graph at once, so they rule out pipelining, as well as skipping the graph
+	// altogether.
+	const bool has_graph_hooks = ctx.trg.second.generate_graph_hook || ctx.trg.second.cull_graph_hook;
+	const bool use_manifest = !has_graph_hooks && g_options.dump_graph.val.as_int32 == 0;
+	string_vector sources;
+	if (use_manifest)
+	{
+		sources = ctx.trg.second.enumerate_sources();
+		if (graph::query_build_manifest(ctx, sources))
+		{
+			cbl::info("Target %s up to date", ctx.trg.first.c_str());
+			cbl::info("Build finished with code 0");
+			return 0;
+		}
+	}
+
+	if (g_options.pipeline.val.as_bool && !has_graph_hooks)
+		return pipeline_build(ctx);
+
+	auto root = graph::generate_cpp_build_graph(ctx);
+	// Flattened once, then kept in line with the graph by culling.
+	auto flat = graph::flatten_build_graph(root);
+	graph::dependency_timestamp_vector manifest;
+	const bool save_manifest = use_manifest && graph::collect_build_manifest(flat, manifest);
+	cull_build(ctx, root, flat);
+	int exit_code = execute_build(ctx, root, flat);
+	if (save_manifest && exit_code == 0)
+		graph::save_build_manifest(ctx, sources, manifest);
+	return exit_code;
+}
+
 namespace bootstrap
 {
 	std::pair<target, configuration> describe(toolchain_map& toolchains)
@@ -190,7 +258,7 @@ namespace bootstrap
 		);
 	}
 
-	int build(toolchain_map& toolchains, int argc, const char *argv[])
+	int build(toolchain_map& toolchains, int argc, const char *argv[], int first_non_opt_arg)
 	{
 		MTR_SCOPE(__FILE__, "cppbuild bootstrapping");
 		using namespace cbl;
@@ -198,18 +266,50 @@ namespace bootstrap
 		auto bootstrap = describe(toolchains);
 
 		auto build = setup_build(bootstrap.first, bootstrap.second, toolchains);
+		auto flat = graph::flatten_build_graph(build.second);
 #if CPPBUILD_GENERATION > 0
 		// Only cull the build graph once we have successfully bootstrapped.
-		cull_build(build.first, build.second);
+		cull_build(build.first, build.second, flat);
 #endif
 
 		std::string staging_dir = path::join(path::get_cppbuild_cache_path(), "bin");
 		if (build.second)
 		{
 			time::scoped_timer _("Rebuild outdated cppbuild executable");
-			int exit_code = execute_build(build.first, build.second);
+			int exit_code = execute_build(build.first, build.second, flat);
+#if !defined(_WIN64)
+			// The whole command line is carried over across exec, not just the arguments past the first non-option one.
+			(void)first_non_opt_arg;
+			if (exit_code == 0)
+			{
+				// Running executables may be renamed over, so stage the new one next to ours and swap it in atomically,
+				// then carry on in its image under the same pid.
+				const std::string current = process::get_current_executable_path();
+				const std::string staged = current + ".new";
+				{
+					MTR_SCOPE(__FILE__, "Deployment");
+					std::shared_ptr<toolchain> tc = toolchains.at(bootstrap.first.second.used_toolchain);
+					if (!tc->deploy_executable_with_debug_symbols(bootstrap.first.second.output.c_str(), staged.c_str())
+						|| !fs::move_file(staged.c_str(), current.c_str(), fs::overwrite))
+					{
+						fs::delete_file(staged.c_str());
+						fatal(int(error_code::failed_bootstrap_deployment), "Failed to overwrite the cppbuild executable");
+					}
+				}
+				info("Successful bootstrap deployment");
+
+				// A jobserver we have started is inherited through MAKEFLAGS, like by any child.
+				string_vector args{ current, "--append-logs" };
+				args.insert(args.end(), argv + 1, argv + argc);
+				// Neither exit handlers nor destructors run across exec.
+				shutdown_traces();
+				process::exec(args);
+				fatal(int(error_code::failed_bootstrap_respawn), "Failed to bootstrap cppbuild, command line %s", join(args, " ").c_str());
+			}
+#else
 			if (exit_code == 0)
 			{
+				// The running executable can't be overwritten, so hand deployment over to the new one once we exit.
 				MTR_SCOPE(__FILE__, "cppbuild deployment dispatch");
 				std::string cmdline = bootstrap.first.second.output;
 				cmdline += " --bootstrap-deploy="
@@ -217,7 +317,7 @@ namespace bootstrap
 					+ "\"" + cbl::process::get_current_executable_path() + "\","
 					+ bootstrap.first.second.used_toolchain;
 				// Pass in any extra arguments we may have received.
-				for (int i = 1; i < argc; ++i)
+				for (int i = first_non_opt_arg + 1; i < argc; ++i)
 				{
 					cmdline += ' ';
 					cmdline += argv[i];
@@ -230,6 +330,7 @@ namespace bootstrap
 				p->detach();
 				exit(0);
 			}
+#endif
 			return exit_code;
 		}
 		else
@@ -334,11 +435,21 @@ int main(int argc, char *argv[])
 	const bool append = g_options.append_logs.val.as_bool || g_options.bootstrap_deploy.val.as_bool;
 	rotate_traces(append);
 	if (g_options.jobs.val.as_int32 > 0)
+	{
+#if defined(_WIN64)
 		cbl::scheduler.Initialize(g_options.jobs.val.as_int32);
+#else
+		// Child processes are reaped asynchronously, so more jobs than cores don't need more threads.
+		cbl::scheduler.Initialize(std::min((uint32_t)g_options.jobs.val.as_int32, std::max(1u, std::thread::hardware_concurrency())));
+#endif
+	}
 	else
 		cbl::scheduler.Initialize();
 	rotate_logs(append);
 
+	// Share job slots with the invoking make, or offer them to the processes we spawn.
+	cbl::jobserver::initialize(g_options.jobs.val.as_int32 > 0 ? (uint32_t)g_options.jobs.val.as_int32 : cbl::scheduler.GetNumTaskThreads());
+
 	cppbuild::background_delete delete_old_logs_and_traces;
 	cbl::scheduler.AddTaskSetToPipe(&delete_old_logs_and_traces);
 
@@ -352,8 +463,8 @@ int main(int argc, char *argv[])
 		return bootstrap::deploy(argc - first_non_opt_arg, argv + first_non_opt_arg, toolchains);
 	}
 
-	// If we were in need of bootstrapping, this call will terminate the process.
-	if (0 != bootstrap::build(toolchains, argc - first_non_opt_arg, const_cast<const char**>(argv + first_non_opt_arg)))
+	// If we were in need of bootstrapping, this call will not return, but replace or terminate the process.
+	if (0 != bootstrap::build(toolchains, argc, const_cast<const char**>(argv), first_non_opt_arg))
 	{
 		cbl::error("FATAL: Failed to bootstrap cppbuild");
 		return (int)error_code::failed_bootstrap_build;
@@ -398,8 +509,18 @@ int main(int argc, char *argv[])
 
 	// Apparently, iterator does not create a reference to the item. GCC deletes the contents of targets after the call to setup_build().
 	target local_copy{ *it };
+	// Likewise, the context must not refer to the temporary that the map's pair would be converted to.
+	configuration local_cfg{ *cfg };
 
-	auto build = setup_build(local_copy, *cfg, toolchains);
-	cull_build(build.first, build.second);
-	return execute_build(build.first, build.second);
+	build_context ctx = setup_build_context(local_copy, local_cfg, toolchains);
+
+	if (g_options.import_cache.val.as_str_ptr)
+		graph::import_cache_snapshot(ctx, g_options.import_cache.val.as_str_ptr);
+
+	int exit_code = build_target(ctx);
+	if (g_options.usage_summary.val.as_int32 > 0)
+		graph::print_usage_summary((size_t)g_options.usage_summary.val.as_int32);
+	if (exit_code == 0 && g_options.export_cache.val.as_str_ptr && !graph::export_cache_snapshot(ctx, g_options.export_cache.val.as_str_ptr))
+		exit_code = (int)error_code::failed_exporting_cache;
+	return exit_code;
 }
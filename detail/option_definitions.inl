@@ -39,6 +39,24 @@ option rotate_log_count =
 	{ option::int64,	'R',"rotate-log-count",	{ 10 },		"Number of old logs to keep.", option::arg_required };
 option fatal_errors =
 	{ option::boolean,	'f',"fatal-errors",	{ false },		"Stop the build immediately upon first error." };
+option scan_dependencies =
+	{ option::boolean,	'S',"scan-dependencies",	{ false },	"Scan header dependencies in a separate preprocessing pass on dependency cache misses, instead of capturing them from the compilation itself. Only affects GCC; MSVC always scans." };
+option debug_cache_keys =
+	{ option::boolean,	0,	"debug-cache-keys",	{ false },	"Store whole compiler command lines in the dependency cache next to their fingerprints, and verify them upon lookup." };
+option content_hashes =
+	{ option::boolean,	0,	"content-hashes",	{ false },	"Judge sources and headers by the hashes of their contents rather than modification times, so that touching a file without changing it does not cause a rebuild. Files are only rehashed when their size, modification time or inode changes." };
+option token_hashes =
+	{ option::boolean,	0,	"token-hashes",	{ false },	"Hash the preprocessed tokens of each translation unit during the dependency scan (implies -S), and skip recompiling it if they are unchanged, e.g. after comment or whitespace-only edits of headers. Line numbers in the debug information of such objects may go stale." };
+option restat =
+	{ option::boolean,	0,	"restat",	{ false },	"Hash objects after compiling them, and if they turn out byte-identical to their previous versions, restore their old modification times, so that dependent targets need not be relinked. Requires a deterministic compiler (e.g. /Brepro for MSVC)." };
+option export_cache =
+	{ option::str_ptr,	0,	"export-cache",	{ false },	"After a successful build, export the dependency cache entries and objects of the target's up to date translation units to a relocatable snapshot file, for seeding fresh checkouts (e.g. CI runners) with --import-cache.", option::arg_required };
+option import_cache =
+	{ option::str_ptr,	0,	"import-cache",	{ false },	"Before building, import the translation units from a snapshot file made with --export-cache whose command lines, sources and headers match the local ones, so that they do not need recompiling.", option::arg_required };
+option usage_summary =
+	{ option::int32,	0,	"usage-summary",	{ int32_t(0) },	"At the end of the build, print the N compiler and linker invocations that took the most CPU time, and the N that peaked at the most memory.", option::arg_required };
+option pipeline =
+	{ option::boolean,	'P',"pipeline",	{ false },		"Start compiling each translation unit as soon as it is found outdated, instead of generating and culling the whole build graph first. Ignored for targets with graph hooks." };
 
 // Internal options, not meant to be exposed to user.
 option append_logs =
@@ -65,6 +65,11 @@ std::string generic_cpp_toolchain::get_response_file_for_cpptu(build_context &ct
 	return get_intermediate_path_for_cpptu(ctx, source_path, ".response");
 }
 
+std::string generic_cpp_toolchain::get_dependency_file_for_cpptu(build_context &ctx, const char *source_path)
+{
+	return get_intermediate_path_for_cpptu(ctx, source_path, ".d");
+}
+
 std::string generic_cpp_toolchain::get_response_file_for_link_product(build_context &ctx, const char *product_path)
 {
 	return get_intermediate_path_for_cpptu(ctx, product_path, ".response");
@@ -73,9 +78,131 @@ std::string generic_cpp_toolchain::get_response_file_for_link_product(build_cont
 void generic_cpp_toolchain::update_response_file(build_context &ctx, const char *response_file, const char *response_str)
 {
 	using namespace cbl::fs;
-	auto result = update_file_backed_cache(response_file, response_str, strlen(response_str));
+	const size_t length = strlen(response_str);
+	// Recognise unchanged response files by their recorded fingerprints, without reading them back.
+	const cbl::fingerprint contents = cbl::compute_fingerprint(response_str, length);
+	if (graph::query_response_file_cache(response_file, contents))
+		return;
+	auto result = update_file_backed_cache(response_file, response_str, length);
 	if (result == cache_update_result::outdated_failure)
 		cbl::fatal((int)error_code::failed_writing_response_file, "Failed to write response file, reason: %s", strerror(errno));
+	graph::insert_response_file_cache(response_file, contents);
+}
+
+// Line markers look like `# 123 "file"` in GCC output, and `#line 123 "file"` in MSVC output.
+static bool is_line_marker(const char *s, const char *end)
+{
+	if (s == end || *s != '#')
+		return false;
+	++s;
+	while (s < end && (*s == ' ' || *s == '\t'))
+		++s;
+	return (s < end && isdigit((unsigned char)*s)) || (end - s >= 4 && 0 == strncmp(s, "line", 4));
+}
+
+// Whether whitespace between the two characters may separate tokens that would otherwise merge into one.
+static bool is_separating_whitespace(char prev, char next)
+{
+	auto is_word = [](char c) { return isalnum((unsigned char)c) || c == '_' || c == '$'; };
+	auto is_quote = [](char c) { return c == '"' || c == '\''; };
+	static constexpr const char joinable[] = "+-*/%<>=&|^!:.#";
+	if (is_word(prev) && is_word(next))
+		return true;
+	// Literal prefixes and user-defined suffixes.
+	if ((is_word(prev) && is_quote(next)) || (is_quote(prev) && is_word(next)))
+		return true;
+	// Preprocessing numbers, such as 1e+5.
+	if (prev && strchr("eEpP", prev) && (next == '+' || next == '-'))
+		return true;
+	return prev && next && strchr(joinable, prev) && strchr(joinable, next);
+}
+
+cbl::fingerprint generic_cpp_toolchain::hash_preprocessed_output(const char *data, size_t size)
+{
+	MTR_SCOPE_FUNC();
+	// Whitespace is dropped, except where it separates tokens, and literals are copied verbatim.
+	std::string tokens;
+	tokens.reserve(size);
+	const char *s = data, *end = data + size;
+	bool line_start = true, pending_space = false;
+	while (s < end)
+	{
+		if (line_start)
+		{
+			const char *it = s;
+			while (it < end && (*it == ' ' || *it == '\t'))
+				++it;
+			if (is_line_marker(it, end))
+			{
+				while (it < end && *it != '\n')
+					++it;
+			}
+			s = it;
+			line_start = false;
+			continue;
+		}
+
+		const char c = *s;
+		if (isspace((unsigned char)c))
+		{
+			line_start = c == '\n';
+			pending_space = !tokens.empty();
+			++s;
+			continue;
+		}
+		if (pending_space && is_separating_whitespace(tokens.back(), c))
+			tokens += ' ';
+		pending_space = false;
+
+		const char *literal_end = nullptr;
+		if (c == '"' && !tokens.empty() && tokens.back() == 'R')
+		{
+			// Raw string literal, terminated by )delimiter".
+			const char *paren = (const char *)memchr(s, '(', std::min<size_t>(end - s, 18));
+			if (paren)
+			{
+				std::string terminator = ")" + std::string(s + 1, paren) + "\"";
+				auto found = std::search(paren, end, terminator.begin(), terminator.end());
+				if (found != end)
+					literal_end = found + terminator.length();
+			}
+		}
+		if (!literal_end && (c == '"' || c == '\''))
+		{
+			literal_end = s + 1;
+			while (literal_end < end && *literal_end != c && *literal_end != '\n')
+				literal_end += *literal_end == '\\' ? 2 : 1;
+			literal_end = literal_end < end ? literal_end + 1 : end;
+		}
+		if (literal_end)
+		{
+			tokens.append(s, literal_end);
+			s = literal_end;
+		}
+		else
+			tokens += *s++;
+	}
+	return cbl::compute_fingerprint(tokens.data(), tokens.size());
+}
+
+void generic_cpp_toolchain::restamp_unchanged_object(
+	build_context &ctx,
+	const char *source,
+	const cbl::fingerprint &previous_tokens,
+	uint64_t previous_newest_dependency,
+	const cbl::fingerprint &tokens)
+{
+	if (previous_tokens != tokens || previous_tokens == cbl::fingerprint{ 0, 0 })
+		return;
+	// The object must have been compiled from the previous tokens, i.e. after all of their dependencies were last
+	// changed. It might not have been, e.g. if the build was interrupted.
+	std::string object = get_object_for_cpptu(ctx, source);
+	const uint64_t object_timestamp = cbl::fs::get_modification_timestamp(object.c_str());
+	if (object_timestamp == 0 || object_timestamp < previous_newest_dependency)
+		return;
+	// Touching the object would make it newer than the product and force a relink, so only its build time is recorded.
+	graph::restamp_output(object.c_str());
+	cbl::log_verbose("Preprocessed tokens of %s unchanged, re-stamped %s", source, object.c_str());
 }
 
 std::shared_ptr<graph::action> generic_cpp_toolchain::generate_compile_action_for_cpptu(
@@ -96,7 +223,7 @@ std::shared_ptr<graph::action> generic_cpp_toolchain::generate_compile_action_fo
 
 	source->type = (graph::action::action_type)graph::cpp_action::source;
 	source->outputs.push_back(tu_path);
-	generate_dependency_actions_for_cpptu(ctx, tu_path, action->response_file.c_str(), response.c_str(), source->inputs);
+	action->dependencies_unknown = !generate_dependency_actions_for_cpptu(ctx, tu_path, action->response_file.c_str(), response.c_str(), source->inputs);
 
 	return action;
 }
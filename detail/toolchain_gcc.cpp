@@ -24,6 +24,7 @@ SOFTWARE.
 
 #include "toolchain_gcc.h"
 #include "../cbl.h"
+#include "detail.h"
 
 // Storage.
 constexpr const char gcc::key[];
@@ -39,7 +40,7 @@ void gcc::pick_toolchain_versions()
 {
 	// FIXME: This is completely unportable.
 	auto version = query_gcc_version("/usr/bin/g++");
-	gcc_path = "\"/usr/bin/g++\"";
+	gcc_path = "/usr/bin/g++";
 }
 
 bool gcc::initialize()
@@ -113,38 +114,160 @@ std::string gcc::generate_linker_response(
 	}
 }
 
-void gcc::generate_dependency_actions_for_cpptu(
+// Parses Make-style dependency rules, as emitted by -M/-MD, and pushes every prerequisite except the source itself.
+static void parse_dependency_rules(const char *rules, const char *end, const char *source, std::function<void(const std::string &)> push_dep)
+{
+	const char *s = strchr(rules, ':');
+	if (s)
+	{
+		s += 1;
+		// Skip leading whitespace.
+		while (*s && isspace(*s))
+			++s;
+		// Skip our source file.
+		const size_t source_length = strlen(source);
+		if (0 == strncmp(s, source, source_length))
+			s += source_length + 1;
+
+		while (s < end)
+		{
+			const char *it = s;
+			// Skip leading whitespace.
+			while (*it && isspace(*it))
+				++it;
+			// Mark start of token.
+			s = it;
+			// Find end of token.
+			while (*it && !isspace(*it))
+				++it;
+			// Ignore line breaks.
+			if (it > s && (it - s != 1 || *s != '\\'))
+			{
+				std::string dep_name(s, it - s);
+				push_dep(dep_name);
+			}
+			s = it + 1;
+		}
+	}
+}
+
+// Hashing tokens takes a preprocessing pass anyway, so dependencies might as well be scanned in the same one.
+static bool scans_dependencies()
+{
+	return g_options.scan_dependencies.val.as_bool || g_options.token_hashes.val.as_bool;
+}
+
+// Appends the transient definitions as separate arguments, so that their values are passed through verbatim.
+static void append_transient_definitions(build_context &ctx, string_vector &argv)
+{
+	for (auto& define : ctx.cfg.second.transient_definitions)
+	{
+		std::string arg = "-D" + define.first;
+		if (!define.second.empty())
+		{
+			arg += "=" + define.second;
+		}
+		argv.push_back(arg);
+	}
+}
+
+// Splits a response into arguments the way GCC reads @file contents: whitespace separates arguments, single and
+// double quotes group them, and a backslash escapes the next character.
+static void split_response(const std::string &response, string_vector &argv)
+{
+	std::string arg;
+	bool in_arg = false;
+	char quote = 0;
+	for (auto it = response.begin(); it != response.end(); ++it)
+	{
+		const char c = *it;
+		if (c == '\\' && it + 1 != response.end())
+		{
+			arg += *++it;
+			in_arg = true;
+		}
+		else if (quote)
+		{
+			if (c == quote)
+				quote = 0;
+			else
+				arg += c;
+		}
+		else if (c == '\'' || c == '"')
+		{
+			quote = c;
+			in_arg = true;
+		}
+		else if (isspace((unsigned char)c))
+		{
+			if (in_arg)
+				argv.push_back(std::move(arg));
+			arg.clear();
+			in_arg = false;
+		}
+		else
+		{
+			arg += c;
+			in_arg = true;
+		}
+	}
+	if (in_arg)
+		argv.push_back(std::move(arg));
+}
+
+static void read_dependency_file(const char *path, std::vector<uint8_t> &buffer)
+{
+	if (FILE *f = fopen(path, "rb"))
+	{
+		fseek(f, 0, SEEK_END);
+		buffer.resize(ftell(f));
+		fseek(f, 0, SEEK_SET);
+		buffer.resize(fread(buffer.data(), 1, buffer.size(), f));
+		fclose(f);
+	}
+}
+
+bool gcc::generate_dependency_actions_for_cpptu(
 	build_context &ctx,
 	const char *source,
-	const char *response_file,
+	const char *,
 	const char *response,
 	std::vector<std::shared_ptr<graph::action>>& inputs)
 {
 	auto push_dep = [&inputs](const std::string &name)
 	{
-		auto dep_action = std::make_shared<graph::cpp_action>();
-		dep_action->type = (graph::action::action_type)graph::cpp_action::include;
-		dep_action->outputs.push_back(name);
-		inputs.push_back(dep_action);
+		inputs.push_back(graph::find_or_create_include_action(name));
 	};
 
-	if (graph::query_dependency_cache(ctx, source, response, push_dep))
-		return;
+	cbl::fingerprint previous_tokens{ 0, 0 };
+	uint64_t previous_newest_dependency = 0;
+	if (graph::query_dependency_cache(ctx, source, response, push_dep, &previous_tokens, &previous_newest_dependency))
+		return true;
 
-	std::string transient_defines;
-	for (auto& define : ctx.cfg.second.transient_definitions)
+	// The compiler will emit a dependency file alongside the object, so don't bother preprocessing twice.
+	if (!scans_dependencies())
+		return false;
+
+	const bool hash_tokens = g_options.token_hashes.val.as_bool;
+	const std::string dep_file = get_dependency_file_for_cpptu(ctx, source);
+	const std::string preprocessed_file = hash_tokens ? get_intermediate_path_for_cpptu(ctx, source, ".ii") : "";
+	string_vector argv{ gcc_path };
+	append_transient_definitions(ctx, argv);
+	if (hash_tokens)
 	{
-		transient_defines += " -D" + define.first;
-		if (!define.second.empty())
-		{
-			transient_defines += "=" + define.second;
-		}
+		// Have the preprocessed tokens written out for hashing, and the rules on the side.
+		argv.push_back("-E");
+		split_response(generate_compiler_response(ctx, preprocessed_file.c_str(), source), argv);
+		argv.insert(argv.end(), { "-MD", "-MF", dep_file });
+	}
+	else
+	{
+		// The regular response names the object as the output, which -M would overwrite, so have the rules printed
+		// out and discard the rest.
+		argv.push_back("-M");
+		split_response(generate_compiler_response(ctx, "/dev/null", source), argv);
+		argv.insert(argv.end(), { "-MF", "-" });
 	}
-
-	std::string cmdline = gcc_path;
-	cmdline += transient_defines;
-	cmdline += " -c -M @";
-	cmdline += response_file;
 
 	std::vector<uint8_t> buffer;
 	auto append_to_buffer = [&buffer](const void *data, size_t byte_count)
@@ -154,42 +277,30 @@ void gcc::generate_dependency_actions_for_cpptu(
 
 	std::string safe_source = cbl::jsonify(source);
 	MTR_SCOPE_S(__FILE__, "Dependency scan", "source", safe_source.c_str());
-	int exit_code = cbl::process::start_sync(cmdline.c_str(), append_to_buffer, append_to_buffer);
+	int exit_code = cbl::process::start_sync(argv, append_to_buffer, append_to_buffer);
 	if (exit_code == 0)
 	{
-		buffer.push_back(0);	// Ensure null termination, so that we may treat data() as C string.
-		const char *s = strchr((char *)buffer.data(), ':');
-		if (s)
+		cbl::fingerprint tokens{ 0, 0 };
+		std::vector<uint8_t> rules;
+		if (hash_tokens)
 		{
-			s += 1;
-			// Skip leading whitespace.
-			while (*s && isspace(*s))
-				++s;
-			// Skip our source file.
-			if (0 == strncmp(s, source, safe_source.size()))
-				s += safe_source.size() + 1;
-
-			const char *end = (const char *)&buffer.back();
-			while (s < end)
 			{
-				const char *it = s;
-				// Skip leading whitespace.
-				while (*it && isspace(*it))
-					++it;
-				// Mark start of token.
-				s = it;
-				// Find end of token.
-				while (*it && !isspace(*it))
-					++it;
-				// Ignore line breaks.
-				if (it - s != 1 || *s != '\\')
-				{
-					std::string dep_name(s, it - s);
-					push_dep(dep_name);
-				}
-				s = it + 1;
+				cbl::fs::file_mapping preprocessed(preprocessed_file.c_str());
+				// Empty files are never mapped.
+				tokens = hash_preprocessed_output(preprocessed.is_valid() ? (const char *)preprocessed.data() : "", preprocessed.size());
+			}
+			cbl::fs::delete_file(preprocessed_file.c_str());
+			read_dependency_file(dep_file.c_str(), rules);
+			if (rules.empty())
+			{
+				cbl::warning("%s: Failed to read dependency file %s, dependencies will be scanned again on next build", source, dep_file.c_str());
+				return false;
 			}
 		}
+		else
+			rules.swap(buffer);
+		rules.push_back(0);	// Ensure null termination, so that we may treat data() as C string.
+		parse_dependency_rules((const char *)rules.data(), (const char *)&rules.back(), source, push_dep);
 
 		graph::dependency_timestamp_vector deps;
 		for (const auto& i : inputs)
@@ -200,40 +311,73 @@ void gcc::generate_dependency_actions_for_cpptu(
 			}
 			deps.push_back(std::make_pair(i->outputs[0], i->output_timestamps[0]));
 		}
-		graph::insert_dependency_cache(ctx, source, response, deps);
+		graph::insert_dependency_cache(ctx, source, response, deps, hash_tokens ? &tokens : nullptr);
+		if (hash_tokens)
+			restamp_unchanged_object(ctx, source, previous_tokens, previous_newest_dependency, tokens);
 	}
 	else
 		cbl::fatal(exit_code, "%s: Dependency scan failed with code %d%s%s", source, exit_code,
 			buffer.empty() ? "" : ", message:\n", buffer.empty() ? "" : (const char *)buffer.data());
+	return true;
 }
 
-cbl::deferred_process gcc::launch_gcc(const char *response, const char *additional_args)
+void gcc::capture_dependencies_for_cpptu(build_context &ctx, const graph::action &compile_action)
 {
-	std::string cmdline = gcc_path;
-	cmdline += " @";
-	cmdline += response;
-	if (additional_args)
-		cmdline += additional_args;
-	return cbl::process::start_deferred(cmdline.c_str());
+	if (scans_dependencies())
+		return;
+
+	assert(compile_action.outputs.size() == 1 && compile_action.inputs.size() > 0);
+	const char *object = compile_action.outputs[0].c_str();
+	const char *source = compile_action.inputs[0]->outputs[0].c_str();
+	std::string safe_source = cbl::jsonify(source);
+	MTR_SCOPE_S(__FILE__, "Dependency capture", "source", safe_source.c_str());
+
+	std::string dep_file = get_dependency_file_for_cpptu(ctx, source);
+	std::vector<uint8_t> buffer;
+	read_dependency_file(dep_file.c_str(), buffer);
+	if (buffer.empty())
+	{
+		cbl::warning("%s: Failed to read dependency file %s, dependencies will be captured again on next build", source, dep_file.c_str());
+		return;
+	}
+	buffer.push_back(0);	// Ensure null termination, so that we may treat data() as C string.
+
+	graph::dependency_timestamp_vector deps;
+	parse_dependency_rules((const char *)buffer.data(), (const char *)&buffer.back(), source,
+		[&deps](const std::string &name)
+		{
+			deps.push_back(std::make_pair(name, graph::find_or_create_include_action(name)->get_oldest_output_timestamp()));
+		});
+	// The response is deterministic, so regenerate it instead of reading back the response file.
+	auto response = generate_compiler_response(ctx, object, source);
+	graph::insert_dependency_cache(ctx, source, response.c_str(), deps);
 }
 
-cbl::deferred_process gcc::schedule_compiler(build_context &ctx, const char *response)
+cbl::deferred_process gcc::launch_gcc(const char *response, const string_vector &additional_args)
 {
-	std::string transient_defines;
-	for (auto& define : ctx.cfg.second.transient_definitions)
+	// Spawned directly off the argument vector, bypassing shell-style command line parsing.
+	string_vector argv{ gcc_path, std::string("@") + response };
+	argv.insert(argv.end(), additional_args.begin(), additional_args.end());
+	return cbl::process::start_deferred(argv);
+}
+
+cbl::deferred_process gcc::schedule_compiler(build_context &ctx, const char *response, const graph::action &compile_action)
+{
+	string_vector additional_args;
+	append_transient_definitions(ctx, additional_args);
+	if (!scans_dependencies())
 	{
-		transient_defines += " -D" + define.first;
-		if (!define.second.empty())
-		{
-			transient_defines += "=" + define.second;
-		}
+		// Have the compiler write out the dependency file as a by-product; see capture_dependencies_for_cpptu().
+		assert(compile_action.inputs.size() > 0);
+		const char *source = compile_action.inputs[0]->outputs[0].c_str();
+		additional_args.insert(additional_args.end(), { "-MD", "-MF", get_dependency_file_for_cpptu(ctx, source) });
 	}
-	return launch_gcc(response, transient_defines.c_str());
+	return launch_gcc(response, additional_args);
 }
 
 cbl::deferred_process gcc::schedule_linker(build_context &ctx, const char *response)
 {
-	return launch_gcc(response, nullptr);
+	return launch_gcc(response, {});
 }
 
 bool gcc::deploy_executable_with_debug_symbols(
@@ -265,7 +409,7 @@ version gcc::query_gcc_version(const char *path)
 		};
 
 		memset(&v, 0, sizeof(v));
-		if (0 == cbl::process::start_sync((std::string(path) + " -v").c_str(), append_to_buffer, append_to_buffer))
+		if (0 == cbl::process::start_sync({ path, "-v" }, append_to_buffer, append_to_buffer))
 		{
 			if (const char *vstr = strstr(buffer.c_str(), header))
 				v.parse(vstr + sizeof(header) - 1);
@@ -45,11 +45,15 @@ struct gcc : public generic_cpp_toolchain
 		const graph::action_vector& source_paths) override;
 
 	cbl::deferred_process schedule_compiler(build_context &,
-		const char *path_to_response_file) override;
+		const char *path_to_response_file,
+		const graph::action &compile_action) override;
 	cbl::deferred_process schedule_linker(build_context &,
 		const char *path_to_response_file) override;
 
-	void generate_dependency_actions_for_cpptu(
+	void capture_dependencies_for_cpptu(build_context &,
+		const graph::action &compile_action) override;
+
+	bool generate_dependency_actions_for_cpptu(
 		build_context &,
 		const char *source,
 		const char *response_file,
@@ -69,7 +73,7 @@ struct gcc : public generic_cpp_toolchain
 protected:
 	static version query_gcc_version(const char *path);
 
-	cbl::deferred_process launch_gcc(const char *response, const char *additional_args);
+	cbl::deferred_process launch_gcc(const char *response, const string_vector &additional_args);
 
 private:
 	std::string gcc_path;
@@ -154,7 +154,7 @@ std::string msvc::generate_linker_response(
 	}
 }
 
-void msvc::generate_dependency_actions_for_cpptu(
+bool msvc::generate_dependency_actions_for_cpptu(
 	build_context &ctx,
 	const char *source,
 	const char *response_file,
@@ -164,14 +164,13 @@ void msvc::generate_dependency_actions_for_cpptu(
 	auto push_dep = [&inputs](const std::string &name)
 	{
 		assert(!name.empty());
-		auto dep_action = std::make_shared<graph::cpp_action>();
-		dep_action->type = (graph::action::action_type)graph::cpp_action::include;
-		dep_action->outputs.push_back(name);
-		inputs.push_back(dep_action);
+		inputs.push_back(graph::find_or_create_include_action(name));
 	};
 
-	if (graph::query_dependency_cache(ctx, source, response, push_dep))
-		return;
+	cbl::fingerprint previous_tokens{ 0, 0 };
+	uint64_t previous_newest_dependency = 0;
+	if (graph::query_dependency_cache(ctx, source, response, push_dep, &previous_tokens, &previous_newest_dependency))
+		return true;
 
 	std::string transient_definitions;
 	for (auto& define : ctx.cfg.second.transient_definitions)
@@ -231,11 +230,32 @@ void msvc::generate_dependency_actions_for_cpptu(
 			}
 			deps.push_back(std::make_pair(i->outputs[0], i->output_timestamps[0]));
 		}
-		graph::insert_dependency_cache(ctx, source, response, deps);
+
+		if (g_options.token_hashes.val.as_bool)
+		{
+			// The notes are interleaved with the preprocessed output, so filter them out before hashing.
+			std::string preprocessed;
+			const char *line = (const char *)buffer.data();
+			const char *end = (const char *)&buffer.back();
+			while (line < end)
+			{
+				const char *nl = (const char *)memchr(line, '\n', end - line);
+				const char *next = nl ? nl + 1 : end;
+				if (0 != strncmp(line, needle, needle_length))
+					preprocessed.append(line, next);
+				line = next;
+			}
+			const auto tokens = hash_preprocessed_output(preprocessed.data(), preprocessed.size());
+			graph::insert_dependency_cache(ctx, source, response, deps, &tokens);
+			restamp_unchanged_object(ctx, source, previous_tokens, previous_newest_dependency, tokens);
+		}
+		else
+			graph::insert_dependency_cache(ctx, source, response, deps);
 	}
 	else
 		cbl::fatal(exit_code, "%s: Dependency scan failed with code %d%s%s", source, exit_code,
 			buffer.empty() ? "" : ", message:\n", buffer.empty() ? "" : (const char *)buffer.data());
+	return true;
 }
 
 cbl::deferred_process msvc::launch_cl_exe(const char *response, const char *additional_args)
@@ -248,7 +268,7 @@ cbl::deferred_process msvc::launch_cl_exe(const char *response, const char *addi
 	return cbl::process::start_deferred(cmdline.c_str());
 }
 
-cbl::deferred_process msvc::schedule_compiler(build_context &ctx, const char *response)
+cbl::deferred_process msvc::schedule_compiler(build_context &ctx, const char *response, const graph::action &)
 {
 	std::string transient_definitions;
 	for (auto& define : ctx.cfg.second.transient_definitions)
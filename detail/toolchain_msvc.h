@@ -47,11 +47,12 @@ struct msvc : public generic_cpp_toolchain
 		const graph::action_vector& source_paths) override;
 
 	cbl::deferred_process schedule_compiler(build_context &,
-		const char *path_to_response_file) override;
+		const char *path_to_response_file,
+		const graph::action &compile_action) override;
 	cbl::deferred_process schedule_linker(build_context &,
 		const char *path_to_response_file) override;
 
-	void generate_dependency_actions_for_cpptu(
+	bool generate_dependency_actions_for_cpptu(
 		build_context &,
 		const char *source,
 		const char *response_file,